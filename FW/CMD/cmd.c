@@ -16,14 +16,16 @@
 #include <stdlib.h>
 #include <util/delay.h>
 #include "../UART/uart.h"
+#include "cmdparser.h"
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
-#include <util/atomic.h>
 #include <stdlib.h>
 #include "avr/eeprom.h"
+#include <util/atomic.h>
+#include <util/crc16.h>
 
 //Constant array which holdes the logarithmic potetntiometer curve of 
-//The alps poti
+//The alps poti (10 bit adc values)
 const uint16_t poti_log_curve[] PROGMEM = 
 	{	10,   10,   11,   11,   11,   11,   12,   13,   13,   14,
 		15,   16,   17,   19,   21,   22,   24,   25,   25,   26,
@@ -36,6 +38,11 @@ const uint16_t poti_log_curve[] PROGMEM =
 		622,  653,  683,  713,  743,  773,  803,  832,  861,  890,
 		919,  947,  974,  996,  1009, 1016, 1020, 1022, 1023, 1023, 1023};
 
+//Returns a point of the potentiometer curve scaled to the resolution of adc_val
+static uint16_t poti_curve_adc(uint8_t idx){
+	return ADC_FROM_10BIT( pgm_read_word( &(poti_log_curve[idx]) ) );
+}
+
 //Converts a integer to a hexadecimal string representation
 char * itoh (char * buf, uint8_t digits, uint16_t number)
 {
@@ -46,44 +53,696 @@ char * itoh (char * buf, uint8_t digits, uint16_t number)
 	return buf;
 }
 
+//Converts a integer to a left aligned decimal string of fixed width (space padded)
+char * itod (char * buf, uint8_t width, uint16_t number)
+{
+	uint8_t digits = 1;
+
+	for (uint16_t n = number; n >= 10; n /= 10){
+		digits++;
+	}
+	if (digits > width){
+		digits = width;
+	}
+	memset(buf, ' ', width);
+	buf[width] = 0;
+	for (; digits--; number /= 10)
+	{
+		buf[digits] = '0' + (number % 10);
+	}
+	return buf;
+}
+
+//Pads a string with spaces to a fixed width, returns a pointer to its end
+char * strpad (char * buf, uint8_t width)
+{
+	uint8_t len = strlen(buf);
+
+	while (len < width){
+		buf[len++] = ' ';
+	}
+	buf[len] = 0;
+	return buf + len;
+}
+
+//Converts a adc value to a volume in percent (8.8 fixed point)
+//by inverting the logarithmic potentiometer curve
+uint16_t adc_to_pct8(uint16_t adc){
+	uint16_t curve_lo;
+	uint16_t curve_hi;
+	uint8_t idx = 100;
+
+	if (adc < poti_curve_adc(0)){
+		return 0;
+	}
+
+	//Search the last curve point below or equal to adc
+	while ( poti_curve_adc(idx) > adc ){
+		idx--;
+	}
+	if (idx == 100){
+		return (uint16_t) 100 << 8;
+	}
+
+	//Interpolate between the curve points
+	curve_lo = poti_curve_adc(idx);
+	curve_hi = poti_curve_adc(idx + 1);
+	return ((uint16_t) idx << 8) + (uint16_t) (((uint32_t) (adc - curve_lo) << 8) / (curve_hi - curve_lo));
+}
+
+//Converts a volume in percent (8.8 fixed point) to a adc value
+//on the logarithmic potentiometer curve
+uint16_t pct8_to_adc(uint16_t pct8){
+	uint8_t idx = pct8 >> 8;
+	uint16_t curve_lo;
+	uint16_t curve_hi;
+
+	if (idx >= 100){
+		return poti_curve_adc(100);
+	}
+
+	//Interpolate between the curve points
+	curve_lo = poti_curve_adc(idx);
+	curve_hi = poti_curve_adc(idx + 1);
+	return curve_lo + (uint16_t) (((uint32_t) (curve_hi - curve_lo) * (pct8 & 0xFF)) >> 8);
+}
+
 //Gets the current adc read value and prints the result to uart0
 void getadcval(uint8_t argc, char *argv[]){
 	
 	char buf[11];
 
-	uart0_puts_p(PSTR("ADC Value: "));
+	chan_puts_p(PSTR("ADC Value: "));
+
+	//Report in 10 bit resolution (compatible to the app)
+	chan_puts(itoa(adc_val_get() >> ADC_EXTRA_BITS, buf, 10));
+	chan_puts_p(PSTR("\r\n"));
+}
+
+//Starts a software timer: expires after ms and then every period ms (0: one-shot)
+//A running timer is restarted, a pending expiry event is cleared
+void tmr_start (uint8_t id, uint16_t ms, uint16_t period){
+	//The counter is written with interrupts disabled, the tick ISR decrements it
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		PROBE_ON(PRB_ATOMIC);
+		tmr[id].cnt = ms ? ms : 1;
+		tmr[id].period = period;
+		tmr[id].evt = FALSE;
+		tmr[id].run = TRUE;
+		PROBE_OFF(PRB_ATOMIC);
+	}
+}
+
+//Stops a software timer and clears a pending expiry event
+void tmr_stop (uint8_t id){
+	//Clear run first: the tick ISR can not set the event afterwards
+	tmr[id].run = FALSE;
+	tmr[id].evt = FALSE;
+}
+
+//Returns TRUE if the software timer is running
+uint8_t tmr_running (uint8_t id){
+	return tmr[id].run;
+}
+
+//Returns TRUE once per expiry of the software timer (consumes the event)
+uint8_t tmr_expired (uint8_t id){
+	if (tmr[id].evt){
+		tmr[id].evt = FALSE;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/*------------------------------------------------------------------------------------------------------
+ * EEPROM JOURNAL (layout: volctrl.h)
+ *------------------------------------------------------------------------------------------------------*/
+
+//IR_KEY_MAX_NUM keys with the longest strings have to fit into the journal together with the settings
+_Static_assert(EE_SETTINGS_LIVE + IR_KEY_MAX_NUM * EE_REC_MAX <= EE_LIVE_MAX, "IR_KEY_MAX_NUM too large for the EEPROM journal");
+
+static uint8_t  ee_head = EE_SEG_NONE;		//Segment which is written
+static uint16_t ee_head_seq;
+static uint8_t  ee_head_off = EE_SEG_SIZE;	//Write offset in the head segment (full: a new segment is opened)
+static uint8_t  ee_seg_valid = 0;			//Segments with a valid header
+static uint8_t  ee_victim = EE_SEG_NONE;	//Oldest segment, its live records are rewritten before it is freed
+static uint32_t ee_dirty = 0;				//Ids (EE_ID_*) with unwritten changes
+static uint16_t ee_loc[NUM_EE_IDS];			//EEPROM address of the last record of each id
+
+//Returns the payload length of a ir key record
+static uint8_t ee_key_len (const ir_key *key, const char *desc){
+	return sizeof(ir_key_data) + 1 + strlen(key->arg_str) + 1 + strlen(desc) + 1;
+}
+
+//Copies the current value of an id to a record payload, returns the payload length
+//A free ir key slot has no payload (deleted)
+static uint8_t ee_payload (uint8_t id, uint8_t *p){
+	uint8_t i;
+
+	if (id < IR_KEY_MAX_NUM){
+		for (i = 0; (i < ir_keyset_len) && (ir_key_slot[i] != id); i++);
+		if (i == ir_keyset_len){
+			return 0;
+		}
+		memcpy(p, &ir_keyset[i].key_data, sizeof(ir_key_data));
+		p[sizeof(ir_key_data)] = ir_keyset[i].cmd_idx;
+		strcpy((char*) p + sizeof(ir_key_data) + 1, ir_keyset[i].arg_str);
+		strcpy((char*) p + sizeof(ir_key_data) + 1 + strlen(ir_keyset[i].arg_str) + 1, ir_key_desc[i]);
+		return ee_key_len(&ir_keyset[i], ir_key_desc[i]);
+	}
+
+	switch (id){
+		case EE_ID_5VLED:
+			*p = pwr_5v_led;
+			return 1;
+		case EE_ID_3V3LED:
+			*p = pwr_3v3_led;
+			return 1;
+		case EE_ID_INCDUR:
+			memcpy(p, &inc_dur, sizeof(inc_dur));
+			return sizeof(inc_dur);
+		default:
+			*p = baud_idx_saved;
+			return 1;
+	}
+}
+
+//Applies a replayed record to the RAM copy, ir keys are stored by slot (compacted by ee_init)
+static void ee_apply (uint8_t id, const uint8_t *p, uint8_t len, uint16_t *keys){
+	const uint8_t *end = p + len;
+	ir_key *key;
+	uint8_t n;
+
+	if (id < IR_KEY_MAX_NUM){
+		key = &ir_keyset[id];
+		*keys &= ~(1 << id);
+		if (len < sizeof(ir_key_data) + 3){
+			return;
+		}
+		memcpy(&key->key_data, p, sizeof(ir_key_data));
+		p += sizeof(ir_key_data);
+		key->cmd_idx = *p++;
+
+		n = strnlen((const char*) p, end - p);
+		if ( (n >= sizeof(key->arg_str)) || (n == end - p) ){
+			return;
+		}
+		strcpy(key->arg_str, (const char*) p);
+		p += n + 1;
+
+		n = strnlen((const char*) p, end - p);
+		if ( (n >= MAX_ARG_LEN) || (n == end - p) ){
+			return;
+		}
+		strcpy(ir_key_desc[id], (const char*) p);
+
+		if (key->cmd_idx < NUM_CMDS){
+			*keys |= (1 << id);
+		}
+	}
+	else if ( (id == EE_ID_5VLED) && (len == 1) ){
+		pwr_5v_led = *p;
+	}
+	else if ( (id == EE_ID_3V3LED) && (len == 1) ){
+		pwr_3v3_led = *p;
+	}
+	else if ( (id == EE_ID_INCDUR) && (len == sizeof(inc_dur)) ){
+		memcpy(&inc_dur, p, sizeof(inc_dur));
+	}
+	else if ( (id == EE_ID_BAUD) && (len == 1) ){
+		baud_idx_saved = *p;
+	}
+}
+
+//Returns the CRC8 of a segment header
+static uint8_t ee_hdr_crc (uint8_t seq_l, uint8_t seq_h){
+	return _crc8_ccitt_update(_crc8_ccitt_update(EE_HDR_SEED, seq_l), seq_h);
+}
+
+//Reads the record at an offset of a segment to ee_buf
+//Returns the record length, 0 if it is invalid (erased, torn or of the previous lap)
+static uint8_t ee_rec_read (uint8_t seg, uint8_t off, uint16_t seq){
+	uint16_t addr = seg * EE_SEG_SIZE + off;
+	uint8_t len;
+	uint8_t crc;
+
+	if (off + 3 > EE_SEG_SIZE){
+		return 0;
+	}
+	len = eeprom_read_byte( (uint8_t*) addr + 1);
+	if ( (eeprom_read_byte( (uint8_t*) addr) >= NUM_EE_IDS) || (len + 3 > EE_REC_MAX) || (off + len + 3 > EE_SEG_SIZE) ){
+		return 0;
+	}
+
+	eeprom_read_block( (void*) ee_buf, (void*) addr, len + 3);
+	crc = (uint8_t) seq;
+	for (uint8_t i = 0; i < len + 2; i++){
+		crc = _crc8_ccitt_update(crc, ee_buf[i]);
+	}
+	return (crc == ee_buf[len + 2]) ? len + 3 : 0;
+}
+
+//Reads a segment header, returns TRUE if it is valid
+//The header is committed after the first byte behind it: the end mark or a valid record has to follow
+static uint8_t ee_seg_read (uint8_t seg, uint16_t *seq){
+	uint8_t hdr[EE_SEG_HDR];
+
+	eeprom_read_block( (void*) hdr, (void*) (seg * EE_SEG_SIZE), EE_SEG_HDR);
+	*seq = hdr[1] | (hdr[2] << 8);
+	if ( (ee_hdr_crc(hdr[1], hdr[2]) != hdr[0]) || (*seq % EE_NUM_SEGS != seg) ){
+		return FALSE;
+	}
+	return (eeprom_read_byte( (uint8_t*) (seg * EE_SEG_SIZE + EE_SEG_HDR)) == EE_ID_ERASED) || ee_rec_read(seg, EE_SEG_HDR, *seq);
+}
+
+//Replays the records of a segment up to the first invalid one
+//Returns the offset behind the last valid record
+static uint8_t ee_seg_replay (uint8_t seg, uint16_t seq, uint16_t *keys){
+	uint8_t off = EE_SEG_HDR;
+	uint8_t len;
+
+	while ( (len = ee_rec_read(seg, off, seq)) ){
+		ee_apply(ee_buf[0], &ee_buf[2], len - 3, keys);
+		ee_loc[ee_buf[0]] = seg * EE_SEG_SIZE + off;
+		off += len;
+	}
+	return off;
+}
+
+//Imports the fixed EEPROM layout of older firmware into the empty journal
+//Erased or damaged values keep the default, keys above IR_KEY_MAX_NUM are dropped.
+//All imported values are marked, their records overwrite the old layout. A power loss before
+//ee_task() has written them loses the values which are not in the journal yet
+static void ee_import (void){
+	uint8_t len = eeprom_read_byte(&eeprom_ir_keyset_len);
+	ir_key *key;
+	char *desc;
+	uint8_t tmp;
+
+	if (len <= EE_OLD_KEY_NUM){
+		for (uint8_t i = 0; (i < len) && (ir_keyset_len < IR_KEY_MAX_NUM); i++){
+			key = &ir_keyset[ir_keyset_len];
+			desc = ir_key_desc[ir_keyset_len];
+			eeprom_read_block( (void*) key, (void*) &eeprom_ir_keyset[i], sizeof(ir_key));
+			eeprom_read_block( (void*) desc, (void*) eeprom_ir_key_desc[i], MAX_ARG_LEN);
+			if ( (key->cmd_idx >= NUM_CMDS) ||
+				 (strnlen(key->arg_str, sizeof(key->arg_str)) == sizeof(key->arg_str)) ||
+				 (strnlen(desc, MAX_ARG_LEN) == MAX_ARG_LEN) ){
+				continue;
+			}
+			ir_key_slot[ir_keyset_len] = ir_keyset_len;
+			ee_mark(EE_ID_KEY + ir_keyset_len);
+			ir_keyset_len++;
+		}
+	}
+
+	tmp = eeprom_read_byte(&eeprom_pwr_5v_led);
+	if (tmp <= 1){
+		pwr_5v_led = tmp;
+		ee_mark(EE_ID_5VLED);
+	}
+	tmp = eeprom_read_byte(&eeprom_pwr_3v3_led);
+	if (tmp <= 1){
+		pwr_3v3_led = tmp;
+		ee_mark(EE_ID_3V3LED);
+	}
+	if (eeprom_read_word(&eeprom_inc_dur) <= 1400){
+		inc_dur = eeprom_read_word(&eeprom_inc_dur);
+		ee_mark(EE_ID_INCDUR);
+	}
+	tmp = eeprom_read_byte(&eeprom_baud_idx);
+	if (tmp < NUM_BAUDS){
+		baud_idx_saved = tmp;
+		ee_mark(EE_ID_BAUD);
+	}
+}
+
+//Loads the settings and the ir keys from the EEPROM journal, ids without a record keep the default
+//Has to be called before interrupts are enabled
+void ee_init (void){
+	uint16_t seq[EE_NUM_SEGS];
+	uint16_t keys = 0;		//Slots with a valid ir key
+	uint8_t seg;
+	uint8_t n;
+
+	ir_keyset_len = 0;
+	pwr_5v_led = 1;
+	pwr_3v3_led = 1;
+	inc_dur = EEPROM_INC_DURATION;
+	baud_idx_saved = BAUD_IDX_DEFAULT;
+	memset(ee_loc, 0xFF, sizeof(ee_loc));
+
+	for (seg = 0; seg < EE_NUM_SEGS; seg++){
+		if (ee_seg_read(seg, &seq[seg])){
+			ee_seg_valid |= (1 << seg);
+		}
+	}
+
+	//Head: valid segment which has no successor in the sequence
+	for (seg = 0; seg < EE_NUM_SEGS; seg++){
+		n = (seg + 1) % EE_NUM_SEGS;
+		if ( (ee_seg_valid & (1 << seg)) && !( (ee_seg_valid & (1 << n)) && (seq[n] == (uint16_t) (seq[seg] + 1)) ) ){
+			ee_head = seg;
+			break;
+		}
+	}
+	if (ee_head == EE_SEG_NONE){
+		//Empty journal (first boot after an update): import the old layout, the first record opens segment 0
+		ee_head = EE_NUM_SEGS - 1;
+		ee_head_seq = 0xFFFF;
+		ee_import();
+		return;
+	}
+	ee_head_seq = seq[ee_head];
+
+	//Number of segments in sequence up to the head, replayed from the oldest
+	for (n = 1; n < EE_NUM_SEGS; n++){
+		seg = (ee_head + EE_NUM_SEGS - n) % EE_NUM_SEGS;
+		if ( !(ee_seg_valid & (1 << seg)) || (seq[seg] != (uint16_t) (ee_head_seq - n)) ){
+			break;
+		}
+	}
+	while (n--){
+		seg = (ee_head + EE_NUM_SEGS - n) % EE_NUM_SEGS;
+		ee_head_off = ee_seg_replay(seg, seq[seg], &keys);
+	}
+
+	//Power loss during a compaction: finish it
+	seg = (ee_head + 1) % EE_NUM_SEGS;
+	if (ee_seg_valid & (1 << seg)){
+		ee_victim = seg;
+	}
+
+	//Compact the keys in slot order (ir_keyset_len <= slot)
+	for (seg = 0; seg < IR_KEY_MAX_NUM; seg++){
+		if (keys & (1 << seg)){
+			ir_keyset[ir_keyset_len] = ir_keyset[seg];
+			memcpy(ir_key_desc[ir_keyset_len], ir_key_desc[seg], MAX_ARG_LEN);
+			ir_key_slot[ir_keyset_len] = seg;
+			ir_keyset_len++;
+		}
+	}
+}
 
-	ATOMIC_BLOCK(ATOMIC_FORCEON){
-		  uart0_puts(itoa(adc_val, buf, 10));
+//Starts the EE_READY ISR which writes ee_buf to the EEPROM
+//inval: value of the commit byte ee_buf[0] while the other bytes are written
+static void ee_write (uint16_t addr, uint8_t len, uint8_t inval){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		PROBE_ON(PRB_ATOMIC);
+		ee_buf_addr = addr;
+		ee_buf_inval = inval;
+		ee_buf_pos = 0;
+		ee_buf_len = len;
+		EECR |= (1 << EERIE);
+		PROBE_OFF(PRB_ATOMIC);
 	}
-	uart0_puts_p(PSTR("\r\n"));
+}
+
+//Appends the next changed record to the EEPROM journal, called every main loop pass
+//One record or segment header per call, written in the background by the EE_READY ISR
+void ee_task (void){
+	uint8_t hdr[EE_SEG_HDR];
+	uint8_t id;
+	uint8_t len;
+	uint8_t crc;
+
+	if (ee_buf_len){
+		return;
+	}
+
+	if (ee_victim != EE_SEG_NONE){
+		//Compaction: rewrite the live records of the oldest segment first
+		for (id = 0; id < NUM_EE_IDS; id++){
+			if ( (ee_loc[id] != EE_LOC_NONE) && (ee_loc[id] / EE_SEG_SIZE == ee_victim) ){
+				break;
+			}
+		}
+		if (id == NUM_EE_IDS){
+			//No live records left -> invalidate the header CRC (one byte), the segment is free
+			eeprom_read_block( (void*) ee_buf, (void*) (ee_victim * EE_SEG_SIZE), EE_SEG_HDR);
+			ee_buf[0] ^= 0xFF;
+			ee_write(ee_victim * EE_SEG_SIZE, EE_SEG_HDR, ee_buf[0]);
+			ee_seg_valid &= ~(1 << ee_victim);
+			ee_victim = EE_SEG_NONE;
+			return;
+		}
+	}
+	else if (ee_dirty){
+		for (id = 0; !(ee_dirty & (1UL << id)); id++);
+	}
+	else {
+		return;
+	}
+	ee_dirty &= ~(1UL << id);
+
+	len = ee_payload(id, &ee_buf[2]);
+
+	//A deleted key needs no record if no older one exists (or if it is compacted)
+	if (!len && ( (ee_loc[id] == EE_LOC_NONE) || (ee_loc[id] / EE_SEG_SIZE == ee_victim) )){
+		ee_loc[id] = EE_LOC_NONE;
+		return;
+	}
+
+	if (ee_head_off + len + 3 > EE_SEG_SIZE){
+		//Head segment full -> open the next (free) one, the record follows with the next call
+		ee_dirty |= (1UL << id);
+		ee_head = (ee_head + 1) % EE_NUM_SEGS;
+		ee_head_seq++;
+		ee_head_off = EE_SEG_HDR;
+		ee_buf[1] = (uint8_t) ee_head_seq;
+		ee_buf[2] = ee_head_seq >> 8;
+		ee_buf[0] = ee_hdr_crc(ee_buf[1], ee_buf[2]);
+		ee_buf[EE_SEG_HDR] = EE_ID_ERASED;
+
+		//The invalid CRC must not match the old header, neither while SEQ_L is new and SEQ_H old
+		eeprom_read_block( (void*) hdr, (void*) (ee_head * EE_SEG_SIZE), EE_SEG_HDR);
+		for (crc = 0; (crc == ee_buf[0]) || (crc == ee_hdr_crc(hdr[1], hdr[2])) || (crc == ee_hdr_crc(ee_buf[1], hdr[2])); crc++);
+		ee_write(ee_head * EE_SEG_SIZE, EE_SEG_HDR + 1, crc);
+		ee_seg_valid |= (1 << ee_head);
+
+		//The following segment is the oldest, it is compacted to keep one segment free
+		id = (ee_head + 1) % EE_NUM_SEGS;
+		if (ee_seg_valid & (1 << id)){
+			ee_victim = id;
+		}
+		return;
+	}
+
+	ee_buf[0] = id;
+	ee_buf[1] = len;
+	crc = (uint8_t) ee_head_seq;
+	for (uint8_t i = 0; i < len + 2; i++){
+		crc = _crc8_ccitt_update(crc, ee_buf[i]);
+	}
+	ee_buf[len + 2] = crc;
+	ee_buf[len + 3] = EE_ID_ERASED;
+
+	//The commit byte is the end mark of the previous record, the end mark is not needed at the segment end
+	ee_loc[id] = ee_head * EE_SEG_SIZE + ee_head_off;
+	ee_head_off += len + 3;
+	ee_write(ee_loc[id], len + 3 + (ee_head_off < EE_SEG_SIZE), EE_ID_ERASED);
+}
+
+//Marks an id (EE_ID_*) as changed, its RAM copy is appended to the journal by ee_task()
+void ee_mark (uint8_t id){
+	ee_dirty |= (1UL << id);
+}
+
+//Returns TRUE while the EEPROM has unwritten changes
+uint8_t ee_busy (void){
+	return ee_dirty || (ee_victim != EE_SEG_NONE) || ee_buf_len || (EECR & (1 << EEPE));
+}
+
+//Flush request: writes the next pending journal record, returns TRUE once all changes are in the EEPROM
+//Does not block (a compaction takes up to ~0.4 s), paths which need durable settings poll it
+uint8_t ee_flush (void){
+	ee_task();
+	return !ee_busy();
+}
+
+//Returns TRUE if the journal has space for another ir key
+uint8_t ee_key_fits (const ir_key *key, const char *desc){
+	//Settings are counted with their default values
+	uint16_t live = EE_SETTINGS_LIVE + ee_key_len(key, desc) + 3;
+
+	for (uint8_t i = 0; i < ir_keyset_len; i++){
+		live += ee_key_len(&ir_keyset[i], ir_key_desc[i]) + 3;
+	}
+	return (live <= EE_LIVE_MAX);
+}
+
+//Adds a ir key in the lowest free journal slot, the keyset is kept in slot order
+void ee_key_add (const ir_key *key, const char *desc){
+	uint8_t i;
+
+	for (i = 0; (i < ir_keyset_len) && (ir_key_slot[i] == i); i++);
+
+	memmove(&ir_keyset[i + 1], &ir_keyset[i], (ir_keyset_len - i) * sizeof(ir_key));
+	memmove(ir_key_desc[i + 1], ir_key_desc[i], (ir_keyset_len - i) * MAX_ARG_LEN);
+	memmove(&ir_key_slot[i + 1], &ir_key_slot[i], ir_keyset_len - i);
+	ir_keyset[i] = *key;
+	strcpy(ir_key_desc[i], desc);
+	ir_key_slot[i] = i;
+	ir_keyset_len++;
+
+	ee_mark(EE_ID_KEY + i);
+}
+
+//Deletes a ir key, a single record marks its slot as free
+void ee_key_del (uint8_t idx){
+	uint8_t slot = ir_key_slot[idx];
+
+	ir_keyset_len--;
+	memmove(&ir_keyset[idx], &ir_keyset[idx + 1], (ir_keyset_len - idx) * sizeof(ir_key));
+	memmove(ir_key_desc[idx], ir_key_desc[idx + 1], (ir_keyset_len - idx) * MAX_ARG_LEN);
+	memmove(&ir_key_slot[idx], &ir_key_slot[idx + 1], ir_keyset_len - idx);
+
+	ee_mark(EE_ID_KEY + slot);
 }
 
 //Start the increment timer
 void inc_timer_start (void){
-	if (inc_timer_stat == FALSE){
-		//Reset Timer count register
-		TCNT3 = 0;
-		
-		//Set the prescaler value to start the counter
-		TCCR3B |= TIMER3_PRESCALER_VAL;
-		
-		//Set timer status flag
-		inc_timer_stat = TRUE;
+	if (!tmr_running(TMR_INC)){
+		tmr_start(TMR_INC, inc_dur, 0);
 	}
 }
 
 //Stops the increment timer
 void inc_timer_stop (void){
-	//clear the prescaler value to stop the counter
-	TCCR3B &= ~TIMER3_PRESCALER_VAL;
-	inc_timer_stat = FALSE;
+	tmr_stop(TMR_INC);
 }
 
-//Resets the increment timer to zero value (re-trigger)
+//Restarts the increment timer with the full inc_duration (re-trigger)
 void inc_timer_rst (void){
-	//Reset Timer count register
-	TCNT3 = 0;
+	tmr_start(TMR_INC, inc_dur, 0);
+}
+
+//Returns the system millisecond tick
+//The tick only increments: a read which was torn by the ISR differs from the
+//second read and is repeated. Interrupts stay enabled.
+uint16_t sys_ms_get (void){
+	uint16_t sys_ms_tmp;
+
+	do {
+		sys_ms_tmp = sys_ms;
+	} while (sys_ms_tmp != sys_ms);
+	return sys_ms_tmp;
+}
+
+#if STATS_ENABLED
+//Returns a timestamp in timer 3 ticks (8 us), wraps after 524 ms
+//sys_ms * (OCR3A + 1) is continuous across the sys_ms overflow (mod 2^16)
+uint16_t stats_ts (void){
+	uint16_t ms;
+	uint8_t cnt;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		PROBE_ON(PRB_ATOMIC);
+		ms = sys_ms;
+		cnt = TCNT3;
+		//Compare match pending, the tick ISR has not incremented sys_ms yet
+		if ( (TIFR3 & (1 << OCF3A)) && (cnt < (OCR3A / 2)) ){
+			ms++;
+		}
+		PROBE_OFF(PRB_ATOMIC);
+	}
+	return ms * (OCR3A + 1) + cnt;
+}
+
+//Marks the start of a measured interval
+void stats_stamp_set (stats_stamp *stamp){
+	stamp->ms = sys_ms_get();
+	stamp->ts = stats_ts();
+}
+
+//Returns the time since the stamp in us, intervals above STATS_LONG_MS with ms resolution
+uint32_t stats_elapsed_us (const stats_stamp *stamp){
+	uint16_t ms = sys_ms_get() - stamp->ms;
+
+	if (ms >= STATS_LONG_MS){
+		return ms * 1000UL;
+	}
+	return (uint16_t) (stats_ts() - stamp->ts) * (TIMER3_PRESCALER * 1000000UL / F_CPU);
+}
+
+//Adds a value to a latency statistic
+void stats_lat_add (stats_lat *lat, uint32_t val){
+	if (val > lat->max){
+		lat->max = val;
+	}
+	if (lat->cnt < UINT16_MAX){
+		lat->sum += val;
+		lat->cnt++;
+	}
+}
+
+//Counts a fsm pass and adds its duration (timer 3 ticks) to the histogram
+//A full bin halves all bins, the distribution is kept
+void stats_pass (uint16_t ticks){
+	uint8_t bin = 0;
+
+	st.loop_cnt++;
+	if (ticks > st.pass_max){
+		st.pass_max = ticks;
+	}
+
+	while ( (bin < STATS_HIST_BINS - 1) && (ticks >= (1U << bin)) ){
+		bin++;
+	}
+	if (st.pass_hist[bin] == UINT16_MAX){
+		for (uint8_t i = 0; i < STATS_HIST_BINS; i++){
+			st.pass_hist[i] >>= 1;
+		}
+	}
+	st.pass_hist[bin]++;
+}
+
+//Prints "<mean> (MAX: <max>)<unit>" of a latency statistic
+static void stats_lat_puts (const stats_lat *lat, const char *unit_p){
+	char buffer[11];
+
+	chan_puts(ultoa(lat->cnt ? (lat->sum / lat->cnt) : 0, buffer, 10));
+	chan_puts_p(unit_p);
+	chan_puts_p(PSTR(" (MAX: "));
+	chan_puts(ultoa(lat->max, buffer, 10));
+	chan_puts_p(unit_p);
+	chan_puts_p(PSTR(")\r\n"));
+}
+#endif
+
+//Returns the latest published adc value
+//The ADC ISR increments adc_seq after each update of adc_val: the read is
+//repeated if the ISR published a new value in between. Interrupts stay enabled.
+uint16_t adc_val_get (void){
+	uint8_t seq;
+	uint16_t adc_val_tmp;
+
+	do {
+		seq = adc_seq;
+		adc_val_tmp = adc_val;
+	} while (seq != adc_seq);
+	return adc_val_tmp;
+}
+
+//Sets the ADC sample rate (Timer0 compare match trigger)
+void adc0_set_rate (uint8_t rate){
+	static uint8_t adc_rate = ADC_RATE_LO;
+
+	if (rate == adc_rate){
+		return;
+	}
+	adc_rate = rate;
+
+	if (rate == ADC_RATE_HI){
+		OCR0A = TIMER0_OCR_HI;
+		TCCR0B = TIMER0_PRESCALER_VAL_HI;
+	}
+	else {
+		OCR0A = TIMER0_OCR_LO;
+		TCCR0B = TIMER0_PRESCALER_VAL_LO;
+	}
+	//Restart the count, TCNT0 could be above the new compare value
+	TCNT0 = 0;
 }
 
 //Checks the GPIO Pins for motor status and returns a value defined in
@@ -105,18 +764,113 @@ uint8_t get_motor_stat(void){
 			break;
 		default: 
 			//ERROR
+			TRACE(TRC_ERROR, TRC_ERR_MOTOR_PINS);
 			error_led(TRUE);
 			break;
 	}
 	return -1;
 }
 
-//Turns the motor off via GPIOs
+//Velocity monitor of the motor potentiometer, has to be called with every new adc value
+//Returns MOTOR_FAULT_STALL if the driven motor does not move the pot and
+//MOTOR_FAULT_RUNAWAY if the pot moves against the rotation direction
+uint8_t motor_monitor(uint16_t adc){
+	static uint8_t  mon_motor_stat = MOTOR_STAT_OFF;
+	static uint16_t mon_adc;	//Position at the last detected movement
+	static uint16_t mon_ms;		//Time of the last detected movement
+	static uint16_t mon_start;	//Time of the motor start
+
+	uint8_t motor_stat = get_motor_stat();
+	uint16_t now = sys_ms_get();
+	int16_t progress;
+
+	if (motor_stat != mon_motor_stat){
+		//Motor started, stopped or changed direction -> restart monitor
+		mon_motor_stat = motor_stat;
+		mon_adc = adc;
+		mon_ms = now;
+		mon_start = now;
+		return MOTOR_FAULT_NONE;
+	}
+
+	if (motor_stat == MOTOR_STAT_OFF){
+		return MOTOR_FAULT_NONE;
+	}
+
+	//Position change in rotation direction (CW increases the adc value)
+	progress = (motor_stat == MOTOR_STAT_CW) ? (int16_t) (adc - mon_adc) : (int16_t) (mon_adc - adc);
+
+	if (progress >= MOTOR_MON_MIN_LSB){
+		//Motor moves
+		mon_adc = adc;
+		mon_ms = now;
+		return MOTOR_FAULT_NONE;
+	}
+
+	if (progress <= -MOTOR_MON_RUNAWAY_LSB){
+		return MOTOR_FAULT_RUNAWAY;
+	}
+
+	//The pot curve is nearly flat at both ends -> allow more time for a position change
+	if ( (adc < MOTOR_MON_FLAT_LO) || (adc > MOTOR_MON_FLAT_HI) ){
+		if ((uint16_t) (now - mon_ms) >= MOTOR_MON_STALL_FLAT_MS) return MOTOR_FAULT_STALL;
+	}
+	//Short window of the high ADC rate after the spin-up
+	else if ( ((uint16_t) (now - mon_start) >= MOTOR_MON_SPINUP_MS) && ((uint16_t) (now - mon_ms) >= MOTOR_MON_STALL_MS) ){
+		return MOTOR_FAULT_STALL;
+	}
+	return MOTOR_FAULT_NONE;
+}
+
+//Logs a motor fault, turns on the error led and reports the fault via uart0
+void log_motor_fault(uint8_t fault){
+	char buffer[4];
+
+	motor_fault_last = fault;
+	motor_fault_cnt++;
+	TRACE(TRC_FAULT, fault);
+	error_led(TRUE);
+
+	bcast_puts_p(PSTR("Motor fault "));
+	bcast_puts(utoa(fault, buffer, 10));
+	if (fault == MOTOR_FAULT_STALL){
+		bcast_puts_p(PSTR(": stall!\r\n"));
+	}
+	else {
+		bcast_puts_p(PSTR(": runaway!\r\n"));
+	}
+}
+
+//Records a change of the motor pins in the trace buffer
+static void trace_motor(void){
+	#if TRACE_ENABLED
+		static uint8_t trace_motor_stat = MOTOR_STAT_OFF;
+		uint8_t motor_stat = get_motor_stat();
+
+		if (motor_stat != trace_motor_stat){
+			trace_motor_stat = motor_stat;
+			trace_rec(TRC_MOTOR, motor_stat);
+		}
+	#endif
+}
+
+//Turns the motor off via GPIOs and starts the dead time
+//set_motor_cw() and set_motor_ccw() do not start the motor until the dead time has passed
 void set_motor_off (void){
 	//Set both motor ctrl pins to low
 	PORTD &=  ~(1 << PIN_MOTOR_CW);
 	PORTD &=  ~(1 << PIN_MOTOR_CCW);
-	_delay_ms(MOTOR_OFF_DELAY_MS);
+	tmr_start(TMR_MOTOR_DEAD, MOTOR_OFF_DELAY_MS, 0);
+	trace_motor();
+}
+
+//Turns the motor off without the motor off delay. Only allowed if the
+//motor is restarted in the same rotation direction (e.g. volume ramp)
+void set_motor_pause (void){
+	//Set both motor ctrl pins to low
+	PORTD &=  ~(1 << PIN_MOTOR_CW);
+	PORTD &=  ~(1 << PIN_MOTOR_CCW);
+	trace_motor();
 }
 
 //Checks if the current adc value is within its allowed range
@@ -138,13 +892,21 @@ uint8_t chk_adc_range(uint16_t val)
 
 //Turns the motor in CCW direction, checks the current motor state
 //and reacts to it (e.g. turn the motor off, before changing the rotation direction)
+//The motor does not start during the dead time: the caller repeats the call
+//until get_motor_stat() returns MOTOR_STAT_CCW
 void set_motor_ccw (void){
 	
 	switch (get_motor_stat()){
 		case MOTOR_STAT_OFF:
+			//Wait for the end of the dead time
+			if (tmr_running(TMR_MOTOR_DEAD)){
+				break;
+			}
+
 			//Motor was off -> turn on in ccw direction
 			PORTD &=  ~(1 << PIN_MOTOR_CW);		//0
 			PORTD |=  (1 << PIN_MOTOR_CCW);		//1
+			trace_motor();
 			break;
 			
 		case MOTOR_STAT_CCW:
@@ -153,14 +915,9 @@ void set_motor_ccw (void){
 			break;
 
 		case MOTOR_STAT_CW:
-			//Motor is turning CW -> Turn off Motor
+			//Motor is turning CW -> Turn off Motor, starts the dead time
+			//A call after the dead time turns the motor on in CCW direction
 			set_motor_off();
-			inc_timer_stop();
-			_delay_ms(MOTOR_OFF_DELAY_MS);
-			
-			//Turn on in CCW direction
-			PORTD &=  ~(1 << PIN_MOTOR_CW);		//0
-			PORTD |=  (1 << PIN_MOTOR_CCW);		//1
 			break;
 
 		default: 
@@ -171,24 +928,27 @@ void set_motor_ccw (void){
 
 //Turns the motor in CW direction, checks the current motor state
 //and reacts to it (e.g. turn the motor off, before changing the rotation direction)
+//The motor does not start during the dead time: the caller repeats the call
+//until get_motor_stat() returns MOTOR_STAT_CW
 void set_motor_cw (void){
 	
 	switch (get_motor_stat()){
 		case MOTOR_STAT_OFF:
+			//Wait for the end of the dead time
+			if (tmr_running(TMR_MOTOR_DEAD)){
+				break;
+			}
+
 			//Motor was off -> turn on in cw direction
 			PORTD |= (1 << PIN_MOTOR_CW);		//1
 			PORTD &=  ~(1 << PIN_MOTOR_CCW);	//0
+			trace_motor();
 			break;
 		
 		case MOTOR_STAT_CCW:
-			//Motor is turning CCW
+			//Motor is turning CCW -> Turn off Motor, starts the dead time
+			//A call after the dead time turns the motor on in CW direction
 			set_motor_off();
-			inc_timer_stop();
-			_delay_ms(MOTOR_OFF_DELAY_MS);
-			
-			//Tur on in cw direction
-			PORTD |= (1 << PIN_MOTOR_CW);		//1
-			PORTD &=  ~(1 << PIN_MOTOR_CCW);	//0
 			break;
 			
 		case MOTOR_STAT_CW:
@@ -203,15 +963,15 @@ void set_motor_cw (void){
 void volup(uint8_t argc, char *argv[]){
 	
 	if (argc > cmd_set[CMD_IDX_VOLUP].arg_cnt ){
-		uart0_puts_p(PSTR("Volup does not expect a argument!\r\n"));
+		cmd_reject(PSTR("Volup does not expect a argument!\r\n"));
 		return;
 	}
 	
 	//Broadcast a notification via UART
-	uart0_puts_p(PSTR("volup\r\n"));
+	chan_puts_p(PSTR("volup\r\n"));
 	
-	//Change FSM_STATE
-	FSM_STATE = STATE_VOLUP;
+	//Request the volume increment
+	fsm_post(EV_REQ_VOLUP);
 	
 }
 
@@ -220,40 +980,41 @@ void voldown(uint8_t argc, char *argv[]){
 	//Broadcast a notification via UART
 	
 	if (argc > cmd_set[CMD_IDX_VOLDOWN].arg_cnt ){
-		uart0_puts_p(PSTR("voldown does not expect a argument!\r\n"));
+		cmd_reject(PSTR("voldown does not expect a argument!\r\n"));
 		return;
 	}
 	
-	uart0_puts_p(PSTR("voldown\r\n"));
+	chan_puts_p(PSTR("voldown\r\n"));
 	
-	//Change FSM_STATE
-	FSM_STATE = STATE_VOLDOWN;
+	//Request the volume decrement
+	fsm_post(EV_REQ_VOLDOWN);
 }
 
 //Sets the FSM state for setvolume and sets the setvol_targ for the volume search
+//An optional second argument sets the duration of a volume ramp in ms
 void setvolume(uint8_t argc, char *argv[]){
 	
-	if (argc > cmd_set[CMD_IDX_SETVOL].arg_cnt){
-		uart0_puts_p(PSTR("Invalid Argument count!\r\n"));
+	if (argc > cmd_set[CMD_IDX_SETVOL].arg_cnt + 1){
+		cmd_reject(PSTR("Invalid Argument count!\r\n"));
 		return;
 	}
 
-	uart0_puts_p(PSTR("setvol\r\n"));
+	chan_puts_p(PSTR("setvol\r\n"));
 
 	int idx;
 
 
 	#if DEBUG_MSG
 		char buffer[5];
-		uart0_puts_p(PSTR("argc: "));
-		uart0_puts(itoa(argc, buffer, 10));
-		uart0_puts_p(PSTR("\r\n"));
+		chan_puts_p(PSTR("argc: "));
+		chan_puts(itoa(argc, buffer, 10));
+		chan_puts_p(PSTR("\r\n"));
 		
 		for (int i=0; i < argc; i++)
 		{
-			uart0_puts_p(PSTR("argv: "));
-			uart0_puts(argv[i]);
-			uart0_puts_p(PSTR("\r\n"));
+			chan_puts_p(PSTR("argv: "));
+			chan_puts(argv[i]);
+			chan_puts_p(PSTR("\r\n"));
 		}
 	#endif
 	
@@ -261,23 +1022,68 @@ void setvolume(uint8_t argc, char *argv[]){
 	idx = atoi( argv[0] );
 	
 	if ( (idx > 100) || (idx < 0) ){
-		uart0_puts_p(PSTR("Argument out of range!\r\n"));
+		cmd_reject(PSTR("Argument out of range!\r\n"));
 		//error_led(TRUE);
 		return;
 	}
+
+	if (argc > cmd_set[CMD_IDX_SETVOL].arg_cnt){
+		//Get the ramp duration
+		int ramp_dur = atoi( argv[1] );
+
+		if ( (ramp_dur > SETVOL_RAMP_MAX_MS) || (ramp_dur < 0) ){
+			cmd_reject(PSTR("Argument out of range!\r\n"));
+			return;
+		}
+
+		if (ramp_dur > 0){
+			setvol_ramp_pct = idx;
+			setvol_ramp_dur = ramp_dur;
+			setvol_targ = poti_curve_adc(idx);
+
+			//Request STATE_SETVOL_RAMP (restarts a running ramp)
+			fsm_post(EV_REQ_RAMP);
+			return;
+		}
+	}
 	
 	//To accsess data from program memory
 	//Adress the data as normal -> take the address &()
 	//use pgm_read marko
-	setvol_targ = pgm_read_word( &(poti_log_curve[idx]) );
-	
-	//Switch to STATE_SETVOL FSM State
-	FSM_STATE = STATE_SETVOL;
-	
+	setvol_targ = poti_curve_adc(idx);
+
+	if (FSM_STATE == STATE_SETVOL_ACT){
+		//A volume search is already running (e.g. slider input from the app)
+		//-> coalesce: only the latest target is pursued
+		setvol_coal_cnt++;
+
+		uint16_t adc_val_tmp = adc_val_get();
+
+		//Keep the motor running if the new target lies ahead in the current rotation direction
+		switch (get_motor_stat()){
+			case MOTOR_STAT_CW:
+				if (setvol_targ >= adc_val_tmp + SETVOL_TOL) return;
+				break;
+			case MOTOR_STAT_CCW:
+				if (setvol_targ + SETVOL_TOL <= adc_val_tmp) return;
+				break;
+			default: break;
+		}
+
+		//The new target is behind the current position (or already reached)
+		//-> let STATE_SETVOL decide about a direction reversal
+		if (abs((int) adc_val_tmp - (int) setvol_targ) >= SETVOL_TOL){
+			setvol_rev_cnt++;
+		}
+	}
+
+	//Request STATE_SETVOL
+	fsm_post(EV_REQ_SETVOL);
+
 	#if DEBUG_MSG
-		uart0_puts_p(PSTR("Target ADC value: "));
-		uart0_puts(itoa(setvol_targ, buffer, 10));
-		uart0_puts_p(PSTR("\r\n"));
+		chan_puts_p(PSTR("Target ADC value: "));
+		chan_puts(itoa(setvol_targ, buffer, 10));
+		chan_puts_p(PSTR("\r\n"));
 	#endif
 }
 
@@ -293,8 +1099,14 @@ void error_led (uint8_t status){
 	}
 }
 
-//Registers a new remote. Waits for a IR-Key and stores 
-//the updated ir keyset in EEPROM
+static ir_key regrem_key;
+static char regrem_desc[MAX_ARG_LEN];
+static uint8_t regrem_active;
+static uint8_t regrem_chan;
+static uint8_t regrem_ani_cnt;
+
+//Registers a new remote. Only the arguments are checked here, the IR-Key
+//is awaited by regrem_task() which stores the updated ir keyset in EEPROM
 void regrem(uint8_t argc, char *argv[]){
 	
 	//check if everything is valid
@@ -304,16 +1116,17 @@ void regrem(uint8_t argc, char *argv[]){
 	//Arg 2 ... end :	CMD Arguments
 	
 	ir_key ir_key_tmp;
-	uint8_t ani_pt_cnt = 0;
-	uint8_t ani_line_cnt = 0;
-	uint16_t timeout_cnt = 0;
-	const uint8_t waitloop_iter_time = 10; //ms
 	uint8_t tmp = 0;
 	char desc[MAX_ARG_LEN];
 	
+	if (regrem_active){
+		cmd_reject(PSTR("regrem: Already waiting for a key\r\n"));
+		return;
+	}
+
 	//Check if there is space for more keys
-	if (ir_keyset_len > IR_KEY_MAX_NUM){
-		uart0_puts_p(PSTR("The maximum numer of keys to register is reached!\r\n"));
+	if (ir_keyset_len >= IR_KEY_MAX_NUM){
+		cmd_reject(PSTR("The maximum numer of keys to register is reached!\r\n"));
 		return;
 	}
 	
@@ -334,14 +1147,14 @@ void regrem(uint8_t argc, char *argv[]){
 	
 	if (tmp == 0){
 		//no valid command was found
-		uart0_puts_p(PSTR("regrem: You tried to register a unknown command\r\n"));
+		cmd_reject(PSTR("regrem: You tried to register a unknown command\r\n"));
 		ir_key_tmp.cmd_idx = 0xFF;
 		return;
 	}
 	
 	//Check if the number of arguments is correnct
 	if ( (argc - 2) != cmd_set[ir_key_tmp.cmd_idx].arg_cnt ){
-		uart0_puts_p(PSTR("regrem: Invalid number of arguments for cmd to register\r\n"));
+		cmd_reject(PSTR("regrem: Invalid number of arguments for cmd to register\r\n"));
 		ir_key_tmp.cmd_idx = 0xFF;
 		return;
 	}
@@ -361,76 +1174,106 @@ void regrem(uint8_t argc, char *argv[]){
 		}
 	}
 	
+	//Check if the EEPROM journal has space for the key
+	if (!ee_key_fits(&ir_key_tmp, desc)){
+		cmd_reject(PSTR("regrem: EEPROM full\r\n"));
+		return;
+	}
+
 	//Wait for of a user input of a new ir-keypress
-	uart0_puts_p(PSTR("Press the desired key on the ir-remote\r\n"));
-	while (!irmp_get_data (&irmp_data)){
+	chan_puts_p(PSTR("Press the desired key on the ir-remote\r\n"));
+	tmr_start(TMR_REGREM, IR_KEY_REG_TIMEOUT*1000U, 0);
+	tmr_start(TMR_ANI, REGREM_ANI_MS, REGREM_ANI_MS);
+
+	regrem_key = ir_key_tmp;
+	strcpy(regrem_desc, desc);
+	regrem_chan = cmd_chan;
+	regrem_ani_cnt = 0;
+	regrem_active = TRUE;
+}
+
+//Returns TRUE while regrem waits for the IR-Key, the fsm hands the next
+//decoded IR frame to regrem_task() instead of executing it
+uint8_t regrem_busy(void){
+	return regrem_active;
+}
+
+//Advances a pending regrem, called every fsm pass. ir_rx is TRUE if irmp_data
+//holds a new IR frame. Prints the wait animation, stores the key or times out
+void regrem_task(uint8_t ir_rx){
+	uint8_t chan_tmp;
+
+	if (!regrem_active){
+		return;
+	}
+
+	//The messages go to the channel which requested the registration
+	chan_tmp = cmd_chan;
+	cmd_chan = regrem_chan;
+
+	if (!ir_rx){
 		//Got no IR Message...
 		//Print Wait Animation
-		if (ani_pt_cnt > 8){
+		if (tmr_expired(TMR_ANI)){
 			
-			if (ani_line_cnt > 15){
-				uart0_putc('\r');
-				ani_line_cnt = 0;
+			//Low priority output, dropped if the transmit buffer is full
+			if (regrem_ani_cnt > 15){
+				chan_putc_lp('\r');
+				regrem_ani_cnt = 0;
 			}
-			uart0_putc('.');
-			ani_line_cnt++;
-			ani_pt_cnt = 0;
+			chan_putc_lp('.');
+			regrem_ani_cnt++;
 		}
-			
-		//Increment Wait time
-		_delay_ms(waitloop_iter_time);
-			
-		ani_pt_cnt++;
-		timeout_cnt++;
 
-		if ( timeout_cnt*waitloop_iter_time >= IR_KEY_REG_TIMEOUT*1000){
-			uart0_puts_p(PSTR("\r\nTimeout!\r\n"));
-			return;
+		if (tmr_expired(TMR_REGREM)){
+			tmr_stop(TMR_ANI);
+			chan_puts_p(PSTR("\r\nTimeout!\r\n"));
+			regrem_active = FALSE;
 		}
+		cmd_chan = chan_tmp;
+		return;
 	}
-	uart0_puts_p(PSTR("\r\n"));
+	tmr_stop(TMR_ANI);
+	tmr_stop(TMR_REGREM);
+	regrem_active = FALSE;
+	chan_puts_p(PSTR("\r\n"));
 
 	//We have a valid Keypress!
-	uart0_puts_p(PSTR("Keypress registered\r\n"));
+	chan_puts_p(PSTR("Keypress registered\r\n"));
 
 	//Fill the Key Data
-	ir_key_tmp.key_data.ir_prot   = irmp_data.protocol;
-	ir_key_tmp.key_data.ir_addr = irmp_data.address;
-	ir_key_tmp.key_data.ir_cmd = irmp_data.command;
-
-	//Copy the data to the ir_keyset array
-	ir_keyset[ir_keyset_len] = ir_key_tmp;
-	ir_keyset_len++;
+	regrem_key.key_data.ir_prot   = irmp_data.protocol;
+	regrem_key.key_data.ir_addr = irmp_data.address;
+	regrem_key.key_data.ir_cmd = irmp_data.command;
 
-	uart0_puts_p(PSTR("Write to EEPROM...\r\n"));
+	chan_puts_p(PSTR("Write to EEPROM...\r\n"));
 
-	//Update EEPROM
-	eeprom_update_block( (void*) desc , (void*) &(eeprom_ir_key_desc[ir_keyset_len - 1][0]), sizeof(desc));
-	eeprom_update_block( (void*) ir_keyset , (void*) eeprom_ir_keyset, sizeof(ir_keyset));
-	eeprom_update_byte( &eeprom_ir_keyset_len, ir_keyset_len);
+	//Copy the data to the ir_keyset array, one journal record (written in the background)
+	ee_key_add(&regrem_key, regrem_desc);
 
 	//Print Info
-	uart0_puts_p(PSTR("Key register successful!\r\n"));
+	chan_puts_p(PSTR("Key register successful!\r\n"));
 	
 	#if DEBUG_MSG
 		char buf[10];
-		uart0_puts_p(PSTR("protocol: 0x"));
+		chan_puts_p(PSTR("protocol: 0x"));
 		itoh (buf, 2, irmp_data.protocol);
-		uart0_puts(buf);
+		chan_puts(buf);
 				
-		uart0_puts_p(PSTR("   address: 0x"));
+		chan_puts_p(PSTR("   address: 0x"));
 		itoh (buf, 4, irmp_data.address);
-		uart0_puts(buf);
+		chan_puts(buf);
 				
-		uart0_puts_p(PSTR("   command: 0x"));
+		chan_puts_p(PSTR("   command: 0x"));
 		itoh (buf, 4, irmp_data.command);
-		uart0_puts(buf);
+		chan_puts(buf);
 				
-		uart0_puts_p(PSTR("   flags: 0x"));
+		chan_puts_p(PSTR("   flags: 0x"));
 		itoh (buf, 2, irmp_data.flags);
-		uart0_puts(buf);
-		uart0_puts_p(PSTR("\r\n"));
+		chan_puts(buf);
+		chan_puts_p(PSTR("\r\n"));
 	#endif
+	cmd_chan = chan_tmp;
 }
 
 //Deletes a ir key with a specified index from the ir_keyset
@@ -438,182 +1281,191 @@ void regrem(uint8_t argc, char *argv[]){
 void delrem(uint8_t argc, char *argv[]){
 	
 	if (argc > cmd_set[CMD_IDX_DELREM].arg_cnt){
-		uart0_puts_p(PSTR("Invalid Argument count!\r\n"));
+		cmd_reject(PSTR("Invalid Argument count!\r\n"));
 		return;
 	}
 	
 	if (ir_keyset_len < 1){
-		uart0_puts_p(PSTR("No remote key registered. Nothing to delete!\r\n"));
+		cmd_reject(PSTR("No remote key registered. Nothing to delete!\r\n"));
 		return;
 	}
 	
-	uart0_puts_p(PSTR("Delete Key with index: "));
-	uart0_puts(argv[0]);
-	uart0_puts_p(PSTR("\r\n"));
+	chan_puts_p(PSTR("Delete Key with index: "));
+	chan_puts(argv[0]);
+	chan_puts_p(PSTR("\r\n"));
 	
 	//Get integer from argument vector (string)
 	uint8_t idx;
-	char desc_tmp[MAX_ARG_LEN];
 	idx = atoi( argv[0] );
 	
 	//Check if the received idx was valid
 	if ( (idx + 1) > ir_keyset_len ){
-		uart0_puts_p(PSTR("Index out of range!\r\n"));
+		cmd_reject(PSTR("Index out of range!\r\n"));
 		return;
 	}
 	
-	//Update the Keyset array
-	for (int i = 0; i < IR_KEY_MAX_NUM; i++){
-		if (i == (IR_KEY_MAX_NUM -1)){
-			//last element is to be deleted
-			//noting to copy
-			break;
-		}
-		else if (i >= idx){
-			//Copy data one index up
-			ir_keyset[i] = ir_keyset[i+1];
-			
-			//Copy description data one index up
-			eeprom_read_block( (void*) desc_tmp , (void*) &(eeprom_ir_key_desc[i+1]), sizeof(eeprom_ir_key_desc[0]));
-			eeprom_write_block( (void*) desc_tmp , (void*) &(eeprom_ir_key_desc[i]), sizeof(eeprom_ir_key_desc[0]));
-		}
-	}
-	
-	//One element was deleted
-	ir_keyset_len--;
-
-	//Update EEPROM
-	eeprom_update_block( (void*) ir_keyset , (void*) eeprom_ir_keyset, sizeof(ir_keyset));
-	eeprom_update_byte( &eeprom_ir_keyset_len, ir_keyset_len);
+	//Update the Keyset array, one journal record (written in the background)
+	ee_key_del(idx);
 	
-	uart0_puts_p(PSTR("Deleted!\r\n"));
+	chan_puts_p(PSTR("Deleted!\r\n"));
 }
 
+static uint8_t showrem_row = SHOWREM_IDLE;
+static uint8_t showrem_half;
+static uint8_t showrem_chan;
+
 //Prints a table of all registered ir keys to uart0
+//Only the header is sent here, the rows are streamed by showrem_task()
 void showrem(uint8_t argc, char *argv[]){
 	
 	if (argc > cmd_set[CMD_IDX_SHOWREM].arg_cnt){
-		uart0_puts_p(PSTR("Invalid Argument count!\r\n"));
+		cmd_reject(PSTR("Invalid Argument count!\r\n"));
 		return;
 	}
 	
-	uart0_puts_p(PSTR(" IDX | PROTOCOL | IR_ADDR | IR_CMD  | CMD          | DESCRIPTION\r\n"));
+	chan_puts_p(PSTR(" IDX | PROTOCOL | IR_ADDR | IR_CMD  | CMD          | DESCRIPTION\r\n"));
+
+	showrem_row = 0;
+	showrem_half = 0;
+	showrem_chan = cmd_chan;
+}
+
+//Returns TRUE while showrem table rows are pending
+uint8_t showrem_busy(void){
+	return showrem_row != SHOWREM_IDLE;
+}
+
+//Advances the showrem table output by one row half if the uart tx buffer
+//has room for it, called every main loop pass. Never blocks
+void showrem_task(void){
+	char buf[SHOWREM_BUF_LEN];
+	char *p = buf;
+	uint8_t i = showrem_row;
+	uint8_t chan_tmp;
 
-	char desc_tmp[MAX_ARG_LEN];
-	char buf[10];
-	//char whitesp[5];
-	
 	const uint8_t column_width_idx = 4;
 	const uint8_t column_width_prot = 9;
 	const uint8_t column_width_ir_cmd = 6;
 	const uint8_t column_width_ir_addr = 6;
 	const uint8_t column_width_cmd = 13;
-	
-	for (int i = 0; i < ir_keyset_len ; i++){
 
+	if (i == SHOWREM_IDLE){
+		return;
+	}
+	if (i >= ir_keyset_len){
+		showrem_row = SHOWREM_IDLE;
+		return;
+	}
+
+	//The table goes to the channel which requested it
+	chan_tmp = cmd_chan;
+	cmd_chan = showrem_chan;
+	if (chan_tx_free() < SHOWREM_BUF_LEN - 1){
+		cmd_chan = chan_tmp;
+		return;
+	}
+
+	if (showrem_half == 0){
 		//INDEX
-		uart0_putc(' ');
-		uart0_puts(itoa(i, buf, 10));
-		for (int i = 0; i < (column_width_idx - strlen(buf)); i++){
-			uart0_putc(' ');
-		}
-		uart0_putc('|');
-		
+		*p++ = ' ';
+		itod(p, column_width_idx, i);
+		p += column_width_idx;
+		*p++ = '|';
+
 		//PROTOCOL
-		uart0_putc(' ');
-		strcpy_P(buf, (char*) pgm_read_word(&(irmp_protocol_names[ir_keyset[i].key_data.ir_prot])));
-		uart0_puts(buf);
-		for (int i = 0; i < (column_width_prot - strlen(buf)); i++){
-			uart0_putc(' ');
-		}
-		uart0_putc('|');
-		
+		*p++ = ' ';
+		strcpy_P(p, (char*) pgm_read_word(&(irmp_protocol_names[ir_keyset[i].key_data.ir_prot])));
+		p = strpad(p, column_width_prot);
+		*p++ = '|';
+
 		//IR_ADDR
-		uart0_puts_p(PSTR(" 0x"));
-		
-		uart0_puts(itoh(buf, 4, ir_keyset[i].key_data.ir_addr));
-		for (int i = 0; i < (column_width_ir_addr - strlen(buf)); i++){
-			uart0_putc(' ');
-		}
-		uart0_putc('|');
-		
-		
+		strcpy_P(p, PSTR(" 0x"));
+		p = strpad(itoh(p + 3, 4, ir_keyset[i].key_data.ir_addr), column_width_ir_addr);
+		*p++ = '|';
+
 		//IR_CMD
-		uart0_puts_p(PSTR(" 0x"));
-		
-		uart0_puts(itoh(buf, 4, ir_keyset[i].key_data.ir_cmd));
-		for (int i = 0; i < (column_width_ir_cmd - strlen(buf)); i++){
-			uart0_putc(' ');
-		}
-		uart0_putc('|');
-		
+		strcpy_P(p, PSTR(" 0x"));
+		p = strpad(itoh(p + 3, 4, ir_keyset[i].key_data.ir_cmd), column_width_ir_cmd);
+		*p++ = '|';
+		*p = 0;
+
+		showrem_half = 1;
+	}
+	else {
 		//CMD
-		uart0_putc(' ');
-		strcpy(buf, cmd_set[ir_keyset[i].cmd_idx].cmd_word);
-		strcat(buf, ir_keyset[i].arg_str);
-		uart0_puts(buf);
-		for (int i = 0; i < (column_width_cmd - strlen(buf)); i++){
-			uart0_putc(' ');
-		}
-		uart0_putc('|');
-		
+		*p++ = ' ';
+		strcpy(p, cmd_set[ir_keyset[i].cmd_idx].cmd_word);
+		strcat(p, ir_keyset[i].arg_str);
+		p = strpad(p, column_width_cmd);
+		*p++ = '|';
+
 		//DESCRIPTION
-		uart0_putc(' ');
-		eeprom_read_block( (void*) desc_tmp , (void*) &(eeprom_ir_key_desc[i]), sizeof(eeprom_ir_key_desc[0]));
-		uart0_puts(desc_tmp);
-		uart0_puts_p(PSTR("\r\n"));
+		*p++ = ' ';
+		memcpy(p, ir_key_desc[i], sizeof(ir_key_desc[0]));
+		p[sizeof(ir_key_desc[0]) - 1] = 0;
+		strcat_P(p, PSTR("\r\n"));
+
+		showrem_half = 0;
+		showrem_row++;
 	}
+
+	chan_puts(buf);
+	cmd_chan = chan_tmp;
 }
 
 //Turns the 5V Power LED on or off
 void set5vled(uint8_t argc, char *argv[]){
 	if (argc > cmd_set[CMD_IDX_SET5VLED].arg_cnt){
-		uart0_puts_p(PSTR("Invalid Argument count!\r\n"));
+		cmd_reject(PSTR("Invalid Argument count!\r\n"));
 		return;
 	}
 	
 	if ( *argv[0] == '1'){
 		//Turn LED on
 		PORTE |= (1 << PWR_5V_LED);
-		eeprom_update_byte(&eeprom_pwr_5v_led, 1);
-		uart0_puts_p(PSTR("5V LED ON!\r\n"));
+		pwr_5v_led = 1;
+		ee_mark(EE_ID_5VLED);
+		chan_puts_p(PSTR("5V LED ON!\r\n"));
 		return;
 		
 	} else if (*argv[0] == '0'){
 		//Turn LED off
 		PORTE &= ~(1 << PWR_5V_LED);
-		eeprom_update_byte(&eeprom_pwr_5v_led, 0);
-		uart0_puts_p(PSTR("5V LED OFF!\r\n"));
+		pwr_5v_led = 0;
+		ee_mark(EE_ID_5VLED);
+		chan_puts_p(PSTR("5V LED OFF!\r\n"));
 		return;
 	}
 	//Invalid argument
-	uart0_puts_p(PSTR("Invalid Argument \r\n"));
+	cmd_reject(PSTR("Invalid Argument \r\n"));
 }
 
 //Turns the 3.3V Power LED on or off
 void set3v3led(uint8_t argc, char *argv[]){
 	
 	if (argc > cmd_set[CMD_IDX_SET3V3LED].arg_cnt){
-		uart0_puts_p(PSTR("Invalid Argument count!\r\n"));
+		cmd_reject(PSTR("Invalid Argument count!\r\n"));
 		return;
 	}
 
 	if (  *argv[0] == '1'){
 		//Turn LED on
 		PORTD |= (1 << PWR_3V3_LED);
-		eeprom_update_byte(&eeprom_pwr_3v3_led, 1);
-		uart0_puts_p(PSTR("3V3 LED ON!\r\n"));
+		pwr_3v3_led = 1;
+		ee_mark(EE_ID_3V3LED);
+		chan_puts_p(PSTR("3V3 LED ON!\r\n"));
 		return;
 		} 
 		else if ( *argv[0] == '0'){
 		//Turn LED off
 		PORTD &= ~(1 << PWR_3V3_LED);
-		eeprom_update_byte(&eeprom_pwr_3v3_led, 0);
-		uart0_puts_p(PSTR("3V3 LED OFF!\r\n"));
+		pwr_3v3_led = 0;
+		ee_mark(EE_ID_3V3LED);
+		chan_puts_p(PSTR("3V3 LED OFF!\r\n"));
 		return;
 	}
 	//Invalid argument
-	uart0_puts_p(PSTR("Invalid Argument \r\n"));
+	cmd_reject(PSTR("Invalid Argument \r\n"));
 }
 
 //Updates the inc_duration value (EEPROM and RAM)
@@ -621,21 +1473,21 @@ void setincdur(uint8_t argc, char *argv[]){
 		
 	//Check if the correct number of arguments is present
 	if (argc > cmd_set[CMD_IDX_SETINCDUR].arg_cnt){
-		uart0_puts_p(PSTR("Invalid Argument count!\r\n"));
+		cmd_reject(PSTR("Invalid Argument count!\r\n"));
 		return;
 	}
 
 	#if DEBUG_MSG
 		char buffer[5];
-		uart0_puts_p(PSTR("argc: "));
-		uart0_puts(itoa(argc, buffer, 10));
-		uart0_puts_p(PSTR("\r\n"));
+		chan_puts_p(PSTR("argc: "));
+		chan_puts(itoa(argc, buffer, 10));
+		chan_puts_p(PSTR("\r\n"));
 			
 		for (int i=0; i < argc; i++)
 		{
-			uart0_puts_p(PSTR("argv: "));
-			uart0_puts(argv[i]);
-			uart0_puts_p(PSTR("\r\n"));
+			chan_puts_p(PSTR("argv: "));
+			chan_puts(argv[i]);
+			chan_puts_p(PSTR("\r\n"));
 		}
 	#endif
 		
@@ -644,37 +1496,662 @@ void setincdur(uint8_t argc, char *argv[]){
 		
 	//Check Range (0...1400ms)
 	if ( (inc_dur_tmp > 1400) || (inc_dur_tmp < 0) ){
-		uart0_puts_p(PSTR("Argument out of range!\r\n"));
+		cmd_reject(PSTR("Argument out of range!\r\n"));
 		//error_led(TRUE);
 		return;
 	}
 		
-	//New inc_dur value is valid -> store to RAM, Timer Register and EEROM
+	//New inc_dur value is valid -> store to RAM and EEROM, used by the next start of the increment timer
 	inc_dur = inc_dur_tmp;
-	OCR3A = (uint16_t) TIMER_COMP_VAL(TIMER3_PRESCALER, inc_dur); //Update INC_DUR  Output Compare Timer Register
-	eeprom_update_word( &eeprom_inc_dur, inc_dur);
+	ee_mark(EE_ID_INCDUR);
 		
-	uart0_puts_p(PSTR("INC_DURATION value updated\r\n"));
+	chan_puts_p(PSTR("INC_DURATION value updated\r\n"));
+}
+
+//Supported UART0 baudrates, all in double speed mode (order of BAUD_IDX_*)
+static const uint32_t baud_rates[NUM_BAUDS] PROGMEM = {BAUDRATE, 250000, 500000, 1000000};
+
+#define BAUD_ERROR(baud) UART_BAUD_ERROR_PERMILLE(UART_BAUD_REAL_DOUBLE_SPEED(UART_BAUD_SELECT_DOUBLE_SPEED(baud, F_CPU), F_CPU), baud)
+
+#if (BAUD_ERROR(BAUDRATE) > BAUD_MAX_ERR_PERMILLE) || (BAUD_ERROR(250000) > BAUD_MAX_ERR_PERMILLE) \
+	|| (BAUD_ERROR(500000) > BAUD_MAX_ERR_PERMILLE) || (BAUD_ERROR(1000000) > BAUD_MAX_ERR_PERMILLE)
+	#error "Baudrate error too large for F_CPU, check baud_rates[]"
+#endif
+
+static uint8_t baud_fallback_idx;
+static uint8_t baud_pending = FALSE;
+static uint16_t baud_ms;
+static uint8_t baud_req = BAUD_IDX_NONE;	//Switch which waits for the end of the queued output
+static uint8_t baud_req_fb;					//The requested switch is the fallback
+static uint16_t baud_idle_ms;				//Start of the empty transmit queue
+
+//Switches UART0 to an entry of the baudrate table right away
+//The transmit queue has to be empty (boot), setbaud switches with baud_request()
+void set_baud(uint8_t idx){
+	uint32_t baud = pgm_read_dword(&baud_rates[idx]);
+
+	uart0_init(UART_BAUD_SELECT_DOUBLE_SPEED(baud, F_CPU));
+	baud_idx = idx;
+}
+
+//Requests a baudrate switch, setbaud_task() applies it once the queued output is sent at the old rate
+static void baud_request(uint8_t idx, uint8_t fallback){
+	baud_req = idx;
+	baud_req_fb = fallback;
+	baud_idle_ms = sys_ms_get();
+}
+
+//Changes the UART0 baudrate: "setbaud <rate>"
+//The new rate has to be confirmed by sending "setbaud <rate>" again at the
+//new rate within BAUD_CONFIRM_MS, otherwise the old rate is restored.
+//A confirmed rate is stored to EEPROM.
+void setbaud(uint8_t argc, char *argv[]){
+	uint32_t baud_tmp;
+	uint8_t idx;
+
+	if (argc > cmd_set[CMD_IDX_SETBAUD].arg_cnt){
+		cmd_reject(PSTR("Invalid Argument count!\r\n"));
+		return;
+	}
+
+	//Get integer from argument vector (string) and search the baudrate table
+	baud_tmp = atol( argv[0] );
+	for (idx = 0; idx < NUM_BAUDS; idx++){
+		if (pgm_read_dword(&baud_rates[idx]) == baud_tmp){
+			break;
+		}
+	}
+	if (idx == NUM_BAUDS){
+		cmd_reject(PSTR("Argument out of range!\r\n"));
+		return;
+	}
+
+	if (idx == baud_idx){
+		//Confirmation at the new rate (or rate unchanged) -> store to EEPROM
+		baud_req = BAUD_IDX_NONE;
+		baud_pending = FALSE;
+		baud_idx_saved = baud_idx;
+		ee_mark(EE_ID_BAUD);
+		ee_flush();
+		chan_puts_p(PSTR("Baudrate saved\r\n"));
+		return;
+	}
+
+	//Keep the last confirmed rate as fallback if a switch is already pending
+	if (!baud_pending){
+		baud_fallback_idx = baud_idx;
+	}
+
+	chan_puts_p(PSTR("Switching baudrate, confirm with setbaud\r\n"));
+	baud_request(idx, FALSE);
+	baud_pending = TRUE;
+}
+
+//Applies a requested baudrate switch and restores the previous baudrate if
+//a switch was not confirmed in time, called every main loop pass
+void setbaud_task(void){
+	if (baud_req != BAUD_IDX_NONE){
+		//Queued output is sent at the old rate, the last two bytes leave the transmit shift register
+		//Pending settings are flushed first, a reset at the new rate finds them in the EEPROM
+		if (uart0_tx_busy() || !ee_flush()){
+			baud_idle_ms = sys_ms_get();
+		}
+		else if ((uint16_t) (sys_ms_get() - baud_idle_ms) >= BAUD_SETTLE_MS){
+			set_baud(baud_req);
+			baud_req = BAUD_IDX_NONE;
+			baud_ms = sys_ms_get();		//The confirmation time starts at the new rate
+			if (baud_req_fb){
+				bcast_puts_p(PSTR("Baudrate not confirmed, fallback!\r\n"));
+			}
+		}
+		return;
+	}
+
+	if (baud_pending && ((uint16_t) (sys_ms_get() - baud_ms) >= BAUD_CONFIRM_MS)){
+		baud_pending = FALSE;
+		baud_request(baud_fallback_idx, TRUE);
+	}
+}
+
+static uint8_t stream_chan;
+static uint8_t stream_bin;
+static uint16_t stream_drop_cnt = 0;
+
+//Starts or stops the telemetry stream: "stream <hz> [b]"
+//1...STREAM_MAX_HZ samples per second, 0 stops the stream. "b" selects
+//binary sample frames, which are also used if the command was a frame
+void stream(uint8_t argc, char *argv[]){
+	uint16_t hz;
+
+	if (argc > cmd_set[CMD_IDX_STREAM].arg_cnt + 1){
+		cmd_reject(PSTR("Invalid Argument count!\r\n"));
+		return;
+	}
+
+	hz = atoi( argv[0] );
+	if (hz > STREAM_MAX_HZ){
+		cmd_reject(PSTR("Argument out of range!\r\n"));
+		return;
+	}
+
+	stream_chan = cmd_src_chan;
+	stream_bin = (cmd_chan == CHAN_NONE) || ( (argc > 1) && (*argv[1] == 'b') );
+
+	//The period is read by the timer ISR
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		stream_period_ms = hz ? (1000 / hz) : 0;
+	}
+	chan_puts_p(PSTR("Stream rate updated\r\n"));
+}
+
+//Sends a telemetry sample if the tick marked one as due, called every main loop pass
+//Text: "pos <adc> <motor stat> <fsm state>", binary: frame with the same values
+//(adc 12 bit, little endian). A sample which does not fit into the tx buffer is dropped.
+void stream_task(uint16_t adc){
+	char buf[20];
+	uint8_t payload[4] = {adc & 0xFF, adc >> 8, get_motor_stat(), FSM_STATE};
+	uint8_t chan_tmp;
+
+	if (!stream_due){
+		return;
+	}
+	stream_due = FALSE;
+
+	chan_tmp = cmd_chan;
+	cmd_chan = stream_chan;
+
+	if (stream_bin){
+		if (chan_tx_free() >= STREAM_FRAME_LEN){
+			frame_send(stream_chan, CMD_IDX_STREAM | FRAME_REPLY, payload, sizeof(payload));
+		}
+		else {
+			stream_drop_cnt++;
+		}
+	}
+	else {
+		strcpy_P(buf, PSTR("pos "));
+		utoa(adc, buf + 4, 10);
+		strcat_P(buf, PSTR(" "));
+		utoa(payload[2], buf + strlen(buf), 10);
+		strcat_P(buf, PSTR(" "));
+		utoa(payload[3], buf + strlen(buf), 10);
+		strcat_P(buf, PSTR("\r\n"));
+
+		if (chan_tx_free() >= strlen(buf)){
+			chan_puts(buf);
+		}
+		else {
+			stream_drop_cnt++;
+		}
+	}
+	cmd_chan = chan_tmp;
+}
+
+#if TRACE_ENABLED
+static trace_entry trace_buf[TRACE_LEN];
+static uint8_t trace_head = 0;		//Next record to write
+static uint8_t trace_cnt = 0;		//Number of valid records
+static uint8_t trace_left = 0;		//Records of the running dump which are not sent yet
+static uint8_t trace_chan;			//Channel of the running dump
+static uint8_t trace_bin;			//Running dump is binary
+
+#if (TRACE_LEN & (TRACE_LEN - 1))
+	#error TRACE_LEN has to be a power of 2
+#endif
+
+//Adds a record to the trace ring buffer, the oldest record is overwritten
+//Called from the main loop only
+void trace_rec(uint8_t type, uint8_t val){
+	trace_entry *rec = &trace_buf[trace_head];
+
+	rec->ms = sys_ms_get();
+	rec->type = type;
+	rec->val = val;
+	rec->adc = adc_val_get();
+
+	trace_head = (trace_head + 1) & (TRACE_LEN - 1);
+	if (trace_cnt < TRACE_LEN){
+		trace_cnt++;
+	}
+}
+#endif
+
+//Dumps the trace buffer, oldest record first: "trace" (text), "trace b" (binary), "trace clear"
+//Text: "<ms> <type> <value> <adc>". Binary: one frame per record (payload: trace_entry),
+//the dump ends with an empty frame. A trace command received as a frame is answered binary
+//Only the dump is started here, the records are sent by trace_task()
+void trace(uint8_t argc, char *argv[]){
+	#if TRACE_ENABLED
+		uint8_t bin = (cmd_chan == CHAN_NONE);
+
+		if (argc > cmd_set[CMD_IDX_TRACE].arg_cnt + 1){
+			cmd_reject(PSTR("Invalid Argument count!\r\n"));
+			return;
+		}
+		if (argc > 0){
+			if (strcmp_P(argv[0], PSTR("clear")) == 0){
+				trace_cnt = 0;
+				trace_left = 0;
+				chan_puts_p(PSTR("Trace cleared\r\n"));
+				return;
+			}
+			bin = (*argv[0] == 'b');
+		}
+
+		trace_bin = bin;
+		trace_chan = bin ? cmd_src_chan : cmd_chan;
+		//Binary dumps always send the terminating frame, also for an empty buffer
+		trace_left = trace_cnt + bin;
+	#else
+		chan_puts_p(PSTR("Trace disabled\r\n"));
+	#endif
+}
+
+#if TRACE_ENABLED
+//Returns TRUE while trace dump records are pending
+uint8_t trace_busy(void){
+	return trace_left != 0;
+}
+
+//Sends the next record of a running trace dump if the uart tx buffer has room
+//for it, called every main loop pass. Never blocks. Records which are added
+//during the dump are sent too, records which are overwritten are skipped
+void trace_task(void){
+	static const char trc_names[][6] PROGMEM = {"STATE", "MOTOR", "CMD", "FAULT", "ERROR"};
+	char buffer[7];
+	trace_entry *rec;
+	uint8_t chan_tmp;
+
+	if (trace_left == 0){
+		return;
+	}
+
+	//The dump goes to the channel which requested it
+	chan_tmp = cmd_chan;
+	cmd_chan = trace_chan;
+	if (chan_tx_free() < TRACE_LINE_MAX){
+		cmd_chan = chan_tmp;
+		return;
+	}
+
+	if (trace_bin){
+		//The terminating frame is counted in trace_left
+		if (trace_left > trace_cnt + 1){
+			trace_left = trace_cnt + 1;
+		}
+		trace_left--;
+		if (trace_left == 0){
+			frame_send(trace_chan, CMD_IDX_TRACE | FRAME_REPLY, NULL, 0);
+		}
+		else {
+			rec = &trace_buf[(trace_head - trace_left) & (TRACE_LEN - 1)];
+			frame_send(trace_chan, CMD_IDX_TRACE | FRAME_REPLY, (uint8_t*) rec, sizeof(trace_entry));
+		}
+		cmd_chan = chan_tmp;
+		return;
+	}
+
+	if (trace_left > trace_cnt){
+		trace_left = trace_cnt;
+	}
+	if (trace_left){
+		rec = &trace_buf[(trace_head - trace_left) & (TRACE_LEN - 1)];
+		trace_left--;
+
+		chan_puts(utoa(rec->ms, buffer, 10));
+		chan_putc(' ');
+		chan_puts_p(trc_names[rec->type]);
+		chan_putc(' ');
+		chan_puts(utoa(rec->val, buffer, 10));
+		chan_putc(' ');
+		chan_puts(utoa(rec->adc, buffer, 10));
+		chan_puts_p(PSTR("\r\n"));
+	}
+	cmd_chan = chan_tmp;
+}
+#endif
+
+//Selects the section which drives the scope probe pin, without argument the selection is printed
+//"probe <off|irmp|adc|uart|tick|fsm|parser|atomic>"
+void probe(uint8_t argc, char *argv[]){
+	#if PROBE_ENABLED
+		static const char prb_names[NUM_PRBS][7] PROGMEM = {"off", "irmp", "adc", "uart", "tick", "fsm", "parser", "atomic"};
+		uint8_t i;
+
+		if (argc > cmd_set[CMD_IDX_PROBE].arg_cnt + 1){
+			cmd_reject(PSTR("Invalid Argument count!\r\n"));
+			return;
+		}
+		if (argc > 0){
+			for (i = 0; i < NUM_PRBS; i++){
+				if (strcmp_P(argv[0], prb_names[i]) == 0){
+					break;
+				}
+			}
+			if (i == NUM_PRBS){
+				cmd_reject(PSTR("Invalid Argument!\r\n"));
+				return;
+			}
+			//Release the pin first, the old section may be interrupted between PROBE_ON and PROBE_OFF
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+				probe_sel = i;
+				PROBE_PORT &= ~(1 << PROBE_PIN);
+			}
+		}
+		chan_puts_p(PSTR("Probe: "));
+		chan_puts_p(prb_names[probe_sel]);
+		chan_puts_p(PSTR("\r\n"));
+	#else
+		chan_puts_p(PSTR("Probe disabled\r\n"));
+	#endif
+}
+
+//Prints the SRAM budget: static data, heap, stack high-water mark and the remaining headroom
+//The stack peak is the lowest byte above the heap which lost the boot paint (stack_paint)
+void mem(uint8_t argc, char *argv[]){
+	char buffer[6];
+	uint8_t *p;
+
+	if (argc > cmd_set[CMD_IDX_MEM].arg_cnt){
+		cmd_reject(PSTR("Invalid Argument count!\r\n"));
+		return;
+	}
+
+	//malloc'd memory (argv strings) is not painted anymore, start the search above the heap top
+	p = __brkval ? (uint8_t*) __brkval : &__heap_start;
+	while ( (p <= (uint8_t*) RAMEND) && (*p == STACK_PAINT) ){
+		p++;
+	}
+
+	chan_puts_p(PSTR("RAM = "));
+	chan_puts(utoa(RAMEND - RAMSTART + 1, buffer, 10));
+	chan_puts_p(PSTR("\r\n"));
+
+	chan_puts_p(PSTR("DATA = "));
+	chan_puts(utoa(&__data_end - &__data_start, buffer, 10));
+	chan_puts_p(PSTR("\r\n"));
+
+	chan_puts_p(PSTR("BSS = "));
+	chan_puts(utoa(&__bss_end - &__bss_start, buffer, 10));
+	chan_puts_p(PSTR("\r\n"));
+
+	chan_puts_p(PSTR("HEAP = "));
+	chan_puts(utoa(__brkval ? (uint8_t*) __brkval - &__heap_start : 0, buffer, 10));
+	chan_puts_p(PSTR("\r\n"));
+
+	chan_puts_p(PSTR("STACK MAX = "));
+	chan_puts(utoa((uint8_t*) RAMEND + 1 - p, buffer, 10));
+	chan_puts_p(PSTR("\r\n"));
+
+	chan_puts_p(PSTR("FREE MIN = "));
+	chan_puts(utoa(p - (__brkval ? (uint8_t*) __brkval : &__heap_start), buffer, 10));
+	chan_puts_p(PSTR("\r\n"));
 }
 
 void getincdur(uint8_t argc, char *argv[]){
 	
 	//Check if the correct number of arguments is present
 	if (argc > cmd_set[CMD_IDX_SETINCDUR].arg_cnt){
-		uart0_puts_p(PSTR("Invalid Argument count!\r\n"));
+		cmd_reject(PSTR("Invalid Argument count!\r\n"));
 		return;
 	}
 		
-	//Check if the values in RAM and EEPROM match
-	if (eeprom_read_word(&eeprom_inc_dur) != inc_dur){
-		uart0_puts_p(PSTR("ERROR: INC_DUR EEPROM RAM MISSMATCH!\r\n"));
+	//Check if the values in RAM and the EEPROM journal match
+	//Skipped while changes are pending, the journal is not flushed here (motor fsm)
+	if (ee_busy()){
+		chan_puts_p(PSTR("EEPROM write pending, check skipped\r\n"));
+	}
+	else if ( (ee_loc[EE_ID_INCDUR] == EE_LOC_NONE) ? (inc_dur != EEPROM_INC_DURATION) :
+		 (eeprom_read_word( (uint16_t*) (ee_loc[EE_ID_INCDUR] + 2)) != inc_dur) ){
+		chan_puts_p(PSTR("ERROR: INC_DUR EEPROM RAM MISSMATCH!\r\n"));
+		TRACE(TRC_ERROR, TRC_ERR_INCDUR);
 		error_led(TRUE);
 	}
 		
 	char buffer[5];
 		
 	//Return the value to the user
-	uart0_puts_p(PSTR("INC_DURATION VALUE = "));
-	uart0_puts(itoa(inc_dur, buffer, 10));
-	uart0_puts_p(PSTR("ms\r\n"));
+	chan_puts_p(PSTR("INC_DURATION VALUE = "));
+	chan_puts(itoa(inc_dur, buffer, 10));
+	chan_puts_p(PSTR("ms\r\n"));
+}
+
+static uint8_t stats_line = STATS_IDLE;
+static uint8_t stats_chan;
+
+//Values of the last report for the rates
+static uint32_t adc_isr_cnt_last = 0;
+static uint16_t adc_isr_ms_last = 0;
+#if STATS_ENABLED
+	static uint32_t loop_cnt_last = 0;
+	static uint16_t loop_ms_last = 0;
+	static uint16_t idle_smp_last = 0;
+#endif
+
+//Prints the runtime statistics, "stats reset" clears them
+//Only the arguments are checked here, the report is streamed by stats_task()
+void stats(uint8_t argc, char *argv[]){
+
+	if (argc > cmd_set[CMD_IDX_STATS].arg_cnt + 1){
+		cmd_reject(PSTR("Invalid Argument count!\r\n"));
+		return;
+	}
+
+	if (argc > 0){
+		if (strcmp_P(argv[0], PSTR("reset")) != 0){
+			cmd_reject(PSTR("Invalid Argument!\r\n"));
+			return;
+		}
+		setvol_coal_cnt = 0;
+		setvol_rev_cnt = 0;
+		motor_fault_cnt = 0;
+		stream_drop_cnt = 0;
+		#if STATS_ENABLED
+			memset(&st, 0, sizeof(st));
+			loop_cnt_last = 0;
+		#endif
+		chan_puts_p(PSTR("Stats reset\r\n"));
+		return;
+	}
+
+	stats_line = 0;
+	stats_chan = cmd_chan;
+}
+
+//Returns TRUE while stats report lines are pending
+uint8_t stats_busy(void){
+	return stats_line != STATS_IDLE;
+}
+
+//Advances the stats report by one line if the uart tx buffer has room
+//for it, called every main loop pass. Never blocks
+void stats_task(void){
+	char buffer[11];
+	uint8_t chan_tmp;
+	uint16_t ms_tmp;
+
+	#if STATS_ENABLED
+		uint16_t idle_smp_tmp;
+		uint32_t hist_sum = 0;
+		uint8_t bin;
+	#endif
+
+	if (stats_line == STATS_IDLE){
+		return;
+	}
+
+	//The report goes to the channel which requested it
+	chan_tmp = cmd_chan;
+	cmd_chan = stats_chan;
+	if (chan_tx_free() < STATS_LINE_MAX){
+		cmd_chan = chan_tmp;
+		return;
+	}
+
+	ms_tmp = sys_ms_get();
+
+	switch (stats_line++){
+		case 0:
+			chan_puts_p(PSTR("SETVOL COALESCED = "));
+			chan_puts(utoa(setvol_coal_cnt, buffer, 10));
+			chan_puts_p(PSTR("\r\n"));
+			break;
+
+		case 1:
+			chan_puts_p(PSTR("SETVOL REVERSED = "));
+			chan_puts(utoa(setvol_rev_cnt, buffer, 10));
+			chan_puts_p(PSTR("\r\n"));
+			break;
+
+		case 2: {
+			//ADC interrupt rate since the last call
+			uint32_t adc_isr_cnt_tmp;
+
+			//Counter only increments -> repeat a torn read
+			do {
+				adc_isr_cnt_tmp = adc_isr_cnt;
+			} while (adc_isr_cnt_tmp != adc_isr_cnt);
+
+			chan_puts_p(PSTR("ADC ISR RATE = "));
+			if (ms_tmp != adc_isr_ms_last){
+				chan_puts(ultoa((adc_isr_cnt_tmp - adc_isr_cnt_last) * 1000UL / (uint16_t) (ms_tmp - adc_isr_ms_last), buffer, 10));
+			}
+			chan_puts_p(PSTR("/s\r\n"));
+			adc_isr_cnt_last = adc_isr_cnt_tmp;
+			adc_isr_ms_last = ms_tmp;
+			break;
+		}
+
+		//Lines 3 to 11 are empty without STATS_ENABLED
+		case 3:
+			#if STATS_ENABLED
+				//Main loop rate and duty cycle since the last call
+				//Counter only increments -> repeat a torn read
+				do {
+					idle_smp_tmp = idle_smp_cnt;
+				} while (idle_smp_tmp != idle_smp_cnt);
+
+				if (ms_tmp != loop_ms_last){
+					chan_puts_p(PSTR("LOOP RATE = "));
+					chan_puts(ultoa((st.loop_cnt - loop_cnt_last) * 1000UL / (uint16_t) (ms_tmp - loop_ms_last), buffer, 10));
+					chan_puts_p(PSTR("/s\r\n"));
+
+					chan_puts_p(PSTR("CPU DUTY = "));
+					chan_puts(utoa(100 - (uint32_t) (uint16_t) (idle_smp_tmp - idle_smp_last) * 100 / (uint16_t) (ms_tmp - loop_ms_last), buffer, 10));
+					chan_puts_p(PSTR("%\r\n"));
+				}
+				loop_cnt_last = st.loop_cnt;
+				loop_ms_last = ms_tmp;
+				idle_smp_last = idle_smp_tmp;
+			#endif
+			break;
+
+		case 4:
+			#if STATS_ENABLED
+				//Pass time: max and the upper bound of the histogram bin which holds the 99th percentile
+				for (bin = 0; bin < STATS_HIST_BINS; bin++){
+					hist_sum += st.pass_hist[bin];
+				}
+				hist_sum -= hist_sum / 100;
+				for (bin = 0; bin < STATS_HIST_BINS - 1; bin++){
+					if (st.pass_hist[bin] >= hist_sum){
+						break;
+					}
+					hist_sum -= st.pass_hist[bin];
+				}
+				chan_puts_p(PSTR("PASS TIME P99 = "));
+				chan_puts(ultoa((1UL << bin) * (TIMER3_PRESCALER * 1000000UL / F_CPU), buffer, 10));
+				chan_puts_p(PSTR("us (MAX: "));
+				chan_puts(ultoa(st.pass_max * (TIMER3_PRESCALER * 1000000UL / F_CPU), buffer, 10));
+				chan_puts_p(PSTR("us)\r\n"));
+			#endif
+			break;
+
+		case 5:
+			#if STATS_ENABLED
+				chan_puts_p(PSTR("WAKE LATENCY = "));
+				stats_lat_puts(&st.wake_lat, PSTR("us"));
+			#endif
+			break;
+
+		case 6:
+			#if STATS_ENABLED
+				chan_puts_p(PSTR("CMD LATENCY = "));
+				stats_lat_puts(&st.cmd_lat, PSTR("us"));
+			#endif
+			break;
+
+		case 7:
+			#if STATS_ENABLED
+				chan_puts_p(PSTR("IR MOTOR LATENCY = "));
+				stats_lat_puts(&st.ir_lat, PSTR("us"));
+			#endif
+			break;
+
+		case 8:
+			#if STATS_ENABLED
+				chan_puts_p(PSTR("SETVOL SETTLE = "));
+				stats_lat_puts(&st.settle, PSTR("ms"));
+			#endif
+			break;
+
+		case 9:
+			//Longer than STATS_LINE_MAX, sent in two parts
+			#if STATS_ENABLED
+				chan_puts_p(PSTR("UART RX OVERFLOW = "));
+				chan_puts(utoa(st.rx_ovf, buffer, 10));
+				chan_puts_p(PSTR(" (FRAME ERR: "));
+				chan_puts(utoa(st.rx_fe, buffer, 10));
+			#endif
+			break;
+
+		case 10:
+			#if STATS_ENABLED
+				chan_puts_p(PSTR(", CMD FRAME ERR: "));
+				chan_puts(utoa(st.frame_err, buffer, 10));
+				chan_puts_p(PSTR(")\r\n"));
+			#endif
+			break;
+
+		case 11:
+			#if STATS_ENABLED
+				chan_puts_p(PSTR("IR FRAMES = "));
+				chan_puts(utoa(st.ir_decoded, buffer, 10));
+				chan_puts_p(PSTR(" (IGNORED: "));
+				chan_puts(utoa(st.ir_ignored, buffer, 10));
+				chan_puts_p(PSTR(", UNKNOWN: "));
+				chan_puts(utoa(st.ir_unknown, buffer, 10));
+				chan_puts_p(PSTR(")\r\n"));
+			#endif
+			break;
+
+		case 12:
+			chan_puts_p(PSTR("STREAM DROPPED = "));
+			chan_puts(utoa(stream_drop_cnt, buffer, 10));
+			chan_puts_p(PSTR("\r\n"));
+			break;
+
+		case 13:
+			chan_puts_p(PSTR("UART TX DROPPED = "));
+			#if defined(USART1_ENABLED)
+				chan_puts(utoa(uart0_tx_dropped() + uart1_tx_dropped(), buffer, 10));
+			#else
+				chan_puts(utoa(uart0_tx_dropped(), buffer, 10));
+			#endif
+			chan_puts_p(PSTR("\r\n"));
+			break;
+
+		default:
+			chan_puts_p(PSTR("MOTOR FAULTS = "));
+			chan_puts(utoa(motor_fault_cnt, buffer, 10));
+			chan_puts_p(PSTR(" (LAST: "));
+			chan_puts(utoa(motor_fault_last, buffer, 10));
+			chan_puts_p(PSTR(")\r\n"));
+
+			//Report complete
+			stats_line = STATS_IDLE;
+			break;
+	}
+
+	cmd_chan = chan_tmp;
 }
\ No newline at end of file
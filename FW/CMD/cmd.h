@@ -47,6 +47,74 @@ typedef struct
 	char arg_str[(MAX_ARG_LEN -1)*MAX_NUM_ARG]; //regrem will the the command with the most arguments, the first arg is the cmd word -> -1
 } ir_key;
 
+//TYPE: SOFTWARE TIMER
+typedef struct
+{
+	uint16_t cnt;		//Remaining ms
+	uint16_t period;	//Reload value in ms, 0: one-shot
+	uint8_t run;		//Timer is running
+	uint8_t evt;		//Expiry event, cleared by tmr_expired()
+} sw_timer;
+
+#if STATS_ENABLED
+//TYPE: STATS_STAMP (start of a measured interval)
+typedef struct
+{
+	uint16_t ms;		//sys_ms
+	uint16_t ts;		//Timer 3 ticks (8 us)
+} stats_stamp;
+
+//TYPE: STATS_LAT (max and mean of a latency)
+typedef struct
+{
+	uint32_t max;
+	uint32_t sum;
+	uint16_t cnt;
+} stats_lat;
+
+//TYPE: STATS_DATA
+typedef struct
+{
+	uint32_t loop_cnt;						//fsm passes
+	uint16_t pass_hist[STATS_HIST_BINS];	//fsm pass time histogram
+	uint16_t pass_max;						//Longest fsm pass in timer 3 ticks
+	stats_lat wake_lat;						//Wake up to fsm dispatch (us)
+	stats_lat cmd_lat;						//UART command receive to dispatch (us)
+	stats_lat ir_lat;						//IR frame to motor start (us)
+	stats_lat settle;						//setvol settle time (ms)
+	uint16_t rx_ovf;						//UART overrun and receive buffer overflows
+	uint16_t rx_fe;							//UART frame errors
+	uint16_t frame_err;						//Binary frames with a CRC or format error
+	uint16_t ir_decoded;					//IR frames decoded
+	uint16_t ir_ignored;					//IR commands dismissed during a motion
+	uint16_t ir_unknown;					//IR frames without a registered key
+} stats_data;
+#endif
+
+//EEPROM JOURNAL RECORD SIZES
+//Largest record: ID | LEN | ir_key_data | cmd_idx | arg_str | desc | CRC8
+#define EE_REC_MAX		(2 + sizeof(ir_key_data) + 1 + sizeof(((ir_key*) 0)->arg_str) + MAX_ARG_LEN + 1)
+//Live records which always fit: a segment is only closed if a record does not fit anymore,
+//one segment is free and one is being compacted
+#define EE_LIVE_MAX		((EE_NUM_SEGS - 2) * (EE_SEG_SIZE - EE_SEG_HDR - EE_REC_MAX + 1))
+//Live records of the settings: 5V LED, 3V3 LED, baudrate (1 byte) and inc_dur (2 bytes)
+#define EE_SETTINGS_LIVE	(3 * (3 + 1) + 3 + sizeof(uint16_t))
+
+#if TRACE_ENABLED
+//TYPE: TRACE_ENTRY
+typedef struct
+{
+	uint16_t ms;		//sys_ms
+	uint8_t type;		//TRC_*
+	uint8_t val;
+	uint16_t adc;		//adc_val (12 bit)
+} trace_entry;
+
+	#define TRACE(type, val)	trace_rec(type, val)
+#else
+	#define TRACE(type, val)
+#endif
+
 /*------------------------------------------------------------------------------------------------------
  * EXTERNAL VARIABLES 
  *------------------------------------------------------------------------------------------------------*/
@@ -54,20 +122,50 @@ typedef struct
 extern command cmd_set[NUM_CMDS];
 extern ir_key ir_keyset[IR_KEY_MAX_NUM];
 extern uint8_t ir_keyset_len;
+extern char ir_key_desc[IR_KEY_MAX_NUM][MAX_ARG_LEN];
+extern uint8_t ir_key_slot[IR_KEY_MAX_NUM];
 extern uint16_t inc_dur;
-
+extern uint8_t baud_idx;
+extern uint8_t baud_idx_saved;
+extern uint8_t pwr_5v_led;
+extern uint8_t pwr_3v3_led;
+extern uint8_t ee_buf[];
+extern uint16_t ee_buf_addr;
+extern uint8_t ee_buf_inval;
+extern volatile uint8_t ee_buf_len;
+extern volatile uint8_t ee_buf_pos;
 extern uint8_t EEMEM eeprom_ir_keyset_len;
 extern uint8_t EEMEM eeprom_pwr_5v_led;
 extern uint8_t EEMEM eeprom_pwr_3v3_led;
-extern ir_key EEMEM eeprom_ir_keyset[IR_KEY_MAX_NUM];
-extern char EEMEM eeprom_ir_key_desc[IR_KEY_MAX_NUM][MAX_ARG_LEN];
+extern ir_key EEMEM eeprom_ir_keyset[EE_OLD_KEY_NUM];
+extern char EEMEM eeprom_ir_key_desc[EE_OLD_KEY_NUM][MAX_ARG_LEN];
 extern uint16_t EEMEM eeprom_inc_dur;
+extern uint8_t EEMEM eeprom_baud_idx;
 
 extern IRMP_DATA irmp_data;
 extern volatile uint8_t FSM_STATE;
-extern volatile uint8_t inc_timer_stat;	//Increment counter status
+extern volatile sw_timer tmr[NUM_TMRS];
+extern volatile uint8_t sys_evt;
+extern uint8_t _end;				//Linker symbols for the mem command
+extern uint8_t __data_start, __data_end, __bss_start, __bss_end, __heap_start;
+extern char *__brkval;
+extern volatile uint16_t idle_smp_cnt;
+#if STATS_ENABLED
+	extern stats_data st;
+#endif
 extern volatile uint16_t adc_val;
+extern volatile uint8_t adc_seq;
+extern volatile uint16_t sys_ms;
+extern volatile uint32_t adc_isr_cnt;
+extern volatile uint16_t stream_period_ms;
+extern volatile uint8_t stream_due;
 extern uint16_t setvol_targ;
+extern uint8_t  setvol_ramp_pct;
+extern uint16_t setvol_ramp_dur;
+extern uint16_t setvol_coal_cnt;
+extern uint16_t setvol_rev_cnt;
+extern uint8_t  motor_fault_last;
+extern uint16_t motor_fault_cnt;
 //extern uint8_t CMD_REC_UART;
 //extern uint8_t CMD_REC_IR;
 
@@ -80,19 +178,48 @@ void voldown(uint8_t argc, char *argv[]);
 void setvolume(uint8_t argc, char *argv[]);
 
 void regrem(uint8_t argc, char *argv[]);
+void regrem_task(uint8_t ir_rx);
 void delrem(uint8_t argc, char *argv[]);
 void showrem(uint8_t argc, char *argv[]);
+void showrem_task(void);
 
 void inc_timer_stop (void);
 void inc_timer_start (void);
 void inc_timer_rst (void);
+void tmr_start (uint8_t id, uint16_t ms, uint16_t period);
+void tmr_stop (uint8_t id);
+uint8_t tmr_running (uint8_t id);
+uint8_t tmr_expired (uint8_t id);
+void ee_init (void);
+void ee_task (void);
+void ee_mark (uint8_t id);
+uint8_t ee_busy (void);
+uint8_t ee_flush (void);
+uint8_t ee_key_fits (const ir_key *key, const char *desc);
+void ee_key_add (const ir_key *key, const char *desc);
+void ee_key_del (uint8_t idx);
+uint16_t sys_ms_get (void);
+#if STATS_ENABLED
+	uint16_t stats_ts (void);
+	void stats_stamp_set (stats_stamp *stamp);
+	uint32_t stats_elapsed_us (const stats_stamp *stamp);
+	void stats_lat_add (stats_lat *lat, uint32_t val);
+	void stats_pass (uint16_t ticks);
+#endif
+uint16_t adc_val_get (void);
+void adc0_set_rate (uint8_t rate);
 
 void set_motor_off (void);
 void set_motor_cw (void);
 void set_motor_ccw (void);
+void set_motor_pause (void);
 
 uint8_t get_motor_stat(void);
+uint8_t motor_monitor(uint16_t adc);
+void log_motor_fault(uint8_t fault);
 uint8_t chk_adc_range(uint16_t);
+uint16_t adc_to_pct8(uint16_t adc);
+uint16_t pct8_to_adc(uint16_t pct8);
 void getadcval(uint8_t argc, char *argv[]);
 
 void error_led(uint8_t);
@@ -100,9 +227,31 @@ void set5vled(uint8_t argc, char *argv[]);
 void set3v3led(uint8_t argc, char *argv[]);
 void setincdur(uint8_t argc, char *argv[]);
 void getincdur(uint8_t argc, char *argv[]);
+void stats(uint8_t argc, char *argv[]);
+void stats_task(void);
+void setbaud(uint8_t argc, char *argv[]);
+void setbaud_task(void);
+void stream(uint8_t argc, char *argv[]);
+void stream_task(uint16_t adc);
+void trace(uint8_t argc, char *argv[]);
+void probe(uint8_t argc, char *argv[]);
+void mem(uint8_t argc, char *argv[]);
+#if TRACE_ENABLED
+	void trace_rec(uint8_t type, uint8_t val);
+	void trace_task(void);
+	uint8_t trace_busy(void);
+#endif
+uint8_t showrem_busy(void);
+uint8_t regrem_busy(void);
+uint8_t stats_busy(void);
+void set_baud(uint8_t idx);
 
 void fsm(void);
+uint8_t fsm_pending(void);
+void fsm_post(uint8_t ev);
 
 char * itoh (char * buf, uint8_t digits, uint16_t number);
+char * itod (char * buf, uint8_t width, uint16_t number);
+char * strpad (char * buf, uint8_t width);
 
 #endif /* CMD_ACTION_H_ */
\ No newline at end of file
@@ -14,8 +14,23 @@
 #include <avr/io.h>
 #include <stdlib.h>
 #include <string.h>
+#include <util/crc16.h>
 
-char uart0_line_buf[LINE_BUF_SIZE];		//Line buffer used by uart0_getln
+char chan_line_buf[NUM_CHANS][LINE_BUF_SIZE];	//Line buffers used by chan_getln
+uint8_t chan_frame_op[NUM_CHANS];				//Opcode if the received line was a binary frame
+uint8_t cmd_chan = CHAN_UART0;					//Channel of the processed command, responses are sent there
+uint8_t cmd_src_chan = CHAN_UART0;				//Channel the processed command was received from (CHAN_ALL for IR)
+
+static uint8_t chan_line_buf_len[NUM_CHANS];	//Received bytes of the current line or frame
+static uint8_t chan_frame_rx[NUM_CHANS];		//TRUE while a binary frame is received
+static uint16_t chan_frame_ms[NUM_CHANS];		//Time of the last received frame byte
+
+static void chan_putc_to(uint8_t chan, char c);
+static uint16_t frame_getb(uint8_t chan, char c);
+static void chan_puts_to(uint8_t chan, const char *s);
+static void chan_puts_p_to(uint8_t chan, const char *progmem_s);
+
+static uint8_t cmd_rejected;		//Set by cmd_reject() during the command function
 
 
 /*************************************************************************
@@ -23,8 +38,9 @@ Function: cmd_parser()
 Purpose:  Parses the string in cmd for arguments and valid commands
           Calls the matching command function with arguments
 Input:    pointer to a char array
-Returns:  0x00 no error occoured
-		  0x01 error occoured
+Returns:  CMD_OK no error occoured
+		  CMD_ERR_PARSE error occoured
+		  CMD_ERR_REJECTED the command function rejected the arguments
 **************************************************************************/			 
 uint8_t cmd_parser(char* cmd){
 					 
@@ -36,6 +52,8 @@ uint8_t cmd_parser(char* cmd){
 	char *argv[MAX_NUM_ARG];	//argument vector containing pointers to strings
 	uint8_t tmp_strlen;
 
+	PROBE_ON(PRB_PARSER);
+
 	//convert input string to lowercase
 	//command interpreter should be case insensitive
 	strlwr(cmd);
@@ -56,14 +74,15 @@ uint8_t cmd_parser(char* cmd){
 					 
 	if (detc_cmd == NULL){
 		//No cmd string found
-		uart0_puts_p(PSTR("Unknown command!\r\n"));
-		return -1;
+		chan_puts_p(PSTR("Unknown command!\r\n"));
+		PROBE_OFF(PRB_PARSER);
+		return CMD_ERR_PARSE;
 	}
 					 
 	//all other tokens are arguments
 	//Collect all arguments in cmd
 	argc = 0;
-	err = 0;
+	err = CMD_OK;
 					 
 	token = strtok(NULL, delim);
 	while(token != NULL)
@@ -74,16 +93,16 @@ uint8_t cmd_parser(char* cmd){
 			//Check number of arguments
 			//if ((argc >= detc_cmd->arg_cnt) || (argc >= MAX_NUM_ARG)){
 			if (argc >= MAX_NUM_ARG){
-				uart0_puts_p(PSTR("The number of arguments exceeds the specified parser limit!\r\n"));
-				err = 1;
+				chan_puts_p(PSTR("The number of arguments exceeds the specified parser limit!\r\n"));
+				err = CMD_ERR_PARSE;
 				break;
 			}
 							 
 			//Check argument string length
 			tmp_strlen = strlen(token); // strlen is not including '\0'
 			if ( tmp_strlen + 1 >= MAX_ARG_LEN ){
-				uart0_puts_p(PSTR("Max arg. string length exceeded!\r\n"));
-				err = 1;
+				chan_puts_p(PSTR("Max arg. string length exceeded!\r\n"));
+				err = CMD_ERR_PARSE;
 				break;
 			}
 							 
@@ -92,8 +111,8 @@ uint8_t cmd_parser(char* cmd){
 							 
 			if (argv[argc] == NULL){
 				//Memory allocation failed
-				uart0_puts_p(PSTR("Memory allocation failed!\r\n"));
-				err = 1;
+				chan_puts_p(PSTR("Memory allocation failed!\r\n"));
+				err = CMD_ERR_PARSE;
 				break;
 			}
 							 
@@ -114,13 +133,18 @@ uint8_t cmd_parser(char* cmd){
 	//Check if required arguments are present
 	//more arguments are OK
 	if ( (argc < detc_cmd->arg_cnt) && (err == 0)){
-		uart0_puts_p(PSTR("Required arguments not present!\r\n"));
-		err=1;
+		chan_puts_p(PSTR("Required arguments not present!\r\n"));
+		err = CMD_ERR_PARSE;
 	}
 					 
 	if (!err){
 		//If all went fine call the command function and pass the arguments
+		TRACE(TRC_CMD, detc_cmd - cmd_set);
+		cmd_rejected = FALSE;
 		detc_cmd->cmd_fun_ptr(argc, argv);
+		if (cmd_rejected){
+			err = CMD_ERR_REJECTED;
+		}
 	}
 
 	//free allocated memory
@@ -128,82 +152,217 @@ uint8_t cmd_parser(char* cmd){
 		free(argv[i]);
 	}
 					 
-	if (err) return 1;
-	else return 0;
+	PROBE_OFF(PRB_PARSER);
+
+	return err;
 };
 
 
 /*************************************************************************
-Function: uart0_getln()
-Purpose:  reads a line from UART buffer (delimiter); '\b' and DEL=127 delete the most
-		  recent chr; '\n' characters are ignored
+Function: cmd_reject()
+Purpose:  reports an error of a command function to cmd_chan, cmd_parser()
+		  returns CMD_ERR_REJECTED for the command (tag event, reply frame)
+Input:    error message in program memory
+Returns:  none
+**************************************************************************/
+void cmd_reject(const char *progmem_s){
+	cmd_rejected = TRUE;
+	chan_puts_p(progmem_s);
+}
+
+
+/*************************************************************************
+Function: frame_getb()
+Purpose:  stores a byte of a binary frame; a complete frame is checked and
+		  translated into a command line in chan_line_buf[chan], so it passes
+		  the same parser and FSM path as a text command
+Input:    chan - channel of the frame; c - received byte
+Returns:  GET_LN_RECEIVED if a valid frame was completed
+		  GET_LN_REC_ERR if a invalid frame was dropped (error reply sent)
+		  GET_LN_NO_BYTES otherwise
+**************************************************************************/
+static uint16_t frame_getb(uint8_t chan, char c){
+	uint8_t *frame = (uint8_t*) chan_line_buf[chan];
+	uint8_t *len = &chan_line_buf_len[chan];
+	uint16_t argv[MAX_NUM_ARG];
+	uint8_t argc;
+	uint8_t crc = 0;
+	char num_buf[6];
+
+	frame[(*len)++] = c;
+
+	//Wait for opcode, length, payload and crc
+	if ( (*len < 2) || ((frame[1] <= FRAME_MAX_PAYLOAD) && (*len < frame[1] + 3)) ){
+		return GET_LN_NO_BYTES;
+	}
+	chan_frame_rx[chan] = FALSE;
+	*len = 0;
+
+	if ( (frame[0] >= NUM_CMDS) || (frame[1] > FRAME_MAX_PAYLOAD) || (frame[1] & 1) ){
+		#if STATS_ENABLED
+			st.frame_err++;
+		#endif
+		frame_reply(chan, frame[0], FRAME_STAT_FORMAT);
+		return GET_LN_REC_ERR;
+	}
+
+	for (uint8_t i = 0; i < frame[1] + 2; i++){
+		crc = _crc8_ccitt_update(crc, frame[i]);
+	}
+	if (crc != frame[frame[1] + 2]){
+		#if STATS_ENABLED
+			st.frame_err++;
+		#endif
+		frame_reply(chan, frame[0], FRAME_STAT_CRC);
+		return GET_LN_REC_ERR;
+	}
+
+	//Translate the frame into "<cmd word> <arg> <arg>"
+	chan_frame_op[chan] = frame[0];
+	argc = frame[1] / 2;
+	for (uint8_t i = 0; i < argc; i++){
+		argv[i] = frame[2 + 2*i] | (frame[3 + 2*i] << 8);
+	}
+	strcpy((char*) frame, cmd_set[chan_frame_op[chan]].cmd_word);
+	for (uint8_t i = 0; i < argc; i++){
+		strcat((char*) frame, " ");
+		strcat((char*) frame, utoa(argv[i], num_buf, 10));
+	}
+	return GET_LN_RECEIVED;
+}
+
+
+/*************************************************************************
+Function: frame_send()
+Purpose:  sends a binary frame (SYNC | OPCODE | LEN | PAYLOAD | CRC8) to a channel
+Input:    chan - channel; opcode; payload - pointer to the payload; len - payload length
+Returns:  none
+**************************************************************************/
+void frame_send(uint8_t chan, uint8_t opcode, const uint8_t *payload, uint8_t len){
+	uint8_t crc;
+
+	crc = _crc8_ccitt_update(0, opcode);
+	crc = _crc8_ccitt_update(crc, len);
+
+	chan_putc_to(chan, FRAME_SYNC);
+	chan_putc_to(chan, opcode);
+	chan_putc_to(chan, len);
+	while (len--){
+		crc = _crc8_ccitt_update(crc, *payload);
+		chan_putc_to(chan, *payload++);
+	}
+	chan_putc_to(chan, crc);
+}
+
+
+/*************************************************************************
+Function: frame_reply()
+Purpose:  sends a binary reply frame with the status and the current
+		  adc value (12 bit) to a channel
+Input:    chan - channel; opcode - opcode of the request; status - FRAME_STAT_*
+Returns:  none
+**************************************************************************/
+void frame_reply(uint8_t chan, uint8_t opcode, uint8_t status){
+	uint16_t adc = adc_val_get();
+	uint8_t payload[3] = {status, adc & 0xFF, adc >> 8};
+
+	frame_send(chan, opcode | FRAME_REPLY, payload, sizeof(payload));
+}
+
+
+/*************************************************************************
+Function: chan_getln()
+Purpose:  reads a line from the UART buffer of a channel (delimiter); '\b' and
+		  DEL=127 delete the most recent chr; '\n' characters are ignored
 		  The implementation is non blocking
-Input:    uart0_line_buf - pointer to a line buffer
-		  rst - boolean, true flushed the uart0_line_buf 
+Input:    chan - CHAN_UART0 or CHAN_UART1, the line is stored in chan_line_buf[chan]
 Returns:  0x01 no bytes available
 		  0x00 one line was read successfully
 		  0xXX02 UART transmit Error occurred (Upper 16 Bytes are the UART error code)
 **************************************************************************/
-uint16_t uart0_getln(char* uart0_line_buf)
+uint16_t chan_getln(uint8_t chan)
 {
-	if (uart0_available() > 0){
-		//Bytes received
-		static uint8_t uart0_line_buf_len = 0;
-		
-		uint16_t rec_val;		//received value
-		char rec_c;				//received character
-		
+	char *line_buf = chan_line_buf[chan];
+	uint8_t *line_buf_len = &chan_line_buf_len[chan];
+	uint16_t rec_val;		//received value
+	uint16_t rec_err;		//receive error
+	char rec_c;				//received character
+
+	#if defined(USART1_ENABLED)
+	if (chan == CHAN_UART1){
+		if (uart1_available() == 0){
+			return GET_LN_NO_BYTES;
+		}
+		rec_val = uart1_getc();
+	}
+	else
+	#endif
+	{
+		if (uart0_available() == 0){
+			return GET_LN_NO_BYTES;
+		}
 		rec_val = uart0_getc();
-		rec_c = (char)rec_val;	//lower 8 bit
+	}
+	rec_c = (char)rec_val;	//lower 8 bit
 	
-		
-		//Check for receive errors
-		if ( uart0_errchk(rec_val) ){
-			return ( uart0_errchk(rec_val) | GET_LN_REC_ERR);
-		}
+	//Check for receive errors
+	rec_err = chan_errchk(chan, rec_val);
+	if (rec_err){
+		return (rec_err | GET_LN_REC_ERR);
+	}
 
+	//Binary frame reception
+	if (chan_frame_rx[chan]){
+		if ( (uint16_t) (sys_ms_get() - chan_frame_ms[chan]) <= FRAME_TIMEOUT_MS ){
+			chan_frame_ms[chan] = sys_ms_get();
+			return frame_getb(chan, rec_c);
+		}
+		//Incomplete frame timed out -> discard it, the byte starts a new line
+		chan_frame_rx[chan] = FALSE;
+		*line_buf_len = 0;
+	}
+	if ( (*line_buf_len == 0) && ((uint8_t) rec_c == FRAME_SYNC) ){
+		chan_frame_rx[chan] = TRUE;
+		chan_frame_ms[chan] = sys_ms_get();
+		return GET_LN_NO_BYTES;
+	}
 
-		if ( rec_c == LINE_DELIMITER ){
-			//EOL reached
-			if (uart0_line_buf_len != 0){
-				//reset buffer index
-				uart0_line_buf_len = 0;
-			}
-			else{
-				//first character was a delimiter -> set terminator to first buffer index
-				//(empty string)
-				uart0_line_buf[uart0_line_buf_len] = 0;
-			}
-			return GET_LN_RECEIVED;
+	if ( rec_c == LINE_DELIMITER ){
+		//EOL reached
+		chan_frame_op[chan] = FRAME_OP_NONE;
+		if (*line_buf_len != 0){
+			//reset buffer index
+			*line_buf_len = 0;
 		}
-		else {
-			//EOL not reached 
-			
-			//Handle backspace and "DEL" (=127)
-			if ( rec_c == '\b' || rec_c == 127 ){
-				//delete the most recent character
-				//Prevent buf len from overflow
-				if (uart0_line_buf_len > 0) uart0_line_buf_len--;
-				uart0_line_buf[uart0_line_buf_len] = 0;
-			}
-			else if (rec_c == '\n'){
-				//Ignore Characters. E.g. '\n' if the EOL is "\r\n" in case of a telnet connection
-				
-			}
-			else {
-				//-> store to buffer
-				if(uart0_line_buf_len < LINE_BUF_SIZE){
-					uart0_line_buf[uart0_line_buf_len++] = rec_c;
-					uart0_line_buf[uart0_line_buf_len] = 0; // append the null terminator
-				}
-				else{
-					//buffer full -> print error message
-					uart0_puts_p(PSTR("Line length exceeds buffer!"));
-					//uart0_flush();
-					//uart0_line_buf[0] = 0
-					return GET_LN_REC_ERR;
-				}
-			}
+		else{
+			//first character was a delimiter -> set terminator to first buffer index
+			//(empty string)
+			line_buf[0] = 0;
+		}
+		return GET_LN_RECEIVED;
+	}
+	
+	//EOL not reached
+	//Handle backspace and "DEL" (=127)
+	if ( rec_c == '\b' || rec_c == 127 ){
+		//delete the most recent character
+		//Prevent buf len from overflow
+		if (*line_buf_len > 0) (*line_buf_len)--;
+		line_buf[*line_buf_len] = 0;
+	}
+	else if (rec_c == '\n'){
+		//Ignore Characters. E.g. '\n' if the EOL is "\r\n" in case of a telnet connection
+	}
+	else {
+		//-> store to buffer, keep space for the null terminator
+		if(*line_buf_len < LINE_BUF_SIZE - 1){
+			line_buf[(*line_buf_len)++] = rec_c;
+			line_buf[*line_buf_len] = 0; // append the null terminator
+		}
+		else{
+			//buffer full -> print error message
+			chan_puts_p_to(chan, PSTR("Line length exceeds buffer!"));
+			return GET_LN_REC_ERR;
 		}
 	}
 	return GET_LN_NO_BYTES;
@@ -283,7 +442,8 @@ uint8_t peek_volctrl(char* buffer){
 			token = strtok(NULL, delim);
 		}
 		
-		if (argc == cmd_set[CMD_IDX_SETVOL].arg_cnt){
+		//setvol with or without the optional ramp duration
+		if ( (argc == cmd_set[CMD_IDX_SETVOL].arg_cnt) || (argc == cmd_set[CMD_IDX_SETVOL].arg_cnt + 1) ){
 			return CMD_IDX_SETVOL;
 		}
 	}
@@ -293,29 +453,163 @@ uint8_t peek_volctrl(char* buffer){
 
 
 /*************************************************************************
-Function: uart0_errchk()
-Purpose:  checks the error bytes and transmits an error message via UART in 
-		  case of an error
-Input:    None
+Function: chan_errchk()
+Purpose:  checks the error bytes and transmits an error message to the
+		  channel in case of an error
+Input:    chan - channel the value was received from; rec_val - received value
 Returns:  boolean false if no error was found; true if an error occured
 **************************************************************************/
-uint16_t uart0_errchk(uint16_t rec_val){
+uint16_t chan_errchk(uint8_t chan, uint16_t rec_val){
 	
 	if (rec_val & UART_FRAME_ERROR ){
-		uart0_puts_p(PSTR("UART_FRAME_ERROR occurred!"));
+		#if STATS_ENABLED
+			st.rx_fe++;
+		#endif
+		chan_puts_p_to(chan, PSTR("UART_FRAME_ERROR occurred!"));
 		return UART_FRAME_ERROR;
 	}
 	else if (rec_val & UART_OVERRUN_ERROR){
-		uart0_puts_p(PSTR("UART_OVERRUN_ERROR occurred!"));
+		#if STATS_ENABLED
+			st.rx_ovf++;
+		#endif
+		chan_puts_p_to(chan, PSTR("UART_OVERRUN_ERROR occurred!"));
 		return UART_OVERRUN_ERROR;
 	}
 	else if (rec_val & UART_BUFFER_OVERFLOW){
-		uart0_puts_p(PSTR("UART_BUFFER_OVERFLOW occurred!"));
+		#if STATS_ENABLED
+			st.rx_ovf++;
+		#endif
+		chan_puts_p_to(chan, PSTR("UART_BUFFER_OVERFLOW occurred!"));
 		return UART_BUFFER_OVERFLOW;
 	}
 	else if (rec_val & UART_NO_DATA){
-		uart0_puts_p(PSTR("UART_NO_DATA occurred!"));
+		chan_puts_p_to(chan, PSTR("UART_NO_DATA occurred!"));
 		return UART_NO_DATA;
 	}
 	return 0;
-}
\ No newline at end of file
+}
+
+
+/*************************************************************************
+Function: chan_putc_to(), chan_puts_to(), chan_puts_p_to()
+Purpose:  transmit a character or string (RAM or program memory) to a channel
+Input:    chan - CHAN_UART0, CHAN_UART1, CHAN_ALL or CHAN_NONE; data to be transmitted
+Returns:  none
+**************************************************************************/
+static void chan_putc_to(uint8_t chan, char c){
+	if (chan == CHAN_UART0 || chan == CHAN_ALL){
+		uart0_putc(c);
+	}
+	#if defined(USART1_ENABLED)
+	if (chan == CHAN_UART1 || chan == CHAN_ALL){
+		uart1_putc(c);
+	}
+	#endif
+}
+
+static void chan_puts_to(uint8_t chan, const char *s){
+	if (chan == CHAN_UART0 || chan == CHAN_ALL){
+		uart0_puts(s);
+	}
+	#if defined(USART1_ENABLED)
+	if (chan == CHAN_UART1 || chan == CHAN_ALL){
+		uart1_puts(s);
+	}
+	#endif
+}
+
+static void chan_puts_p_to(uint8_t chan, const char *progmem_s){
+	if (chan == CHAN_UART0 || chan == CHAN_ALL){
+		uart0_puts_p(progmem_s);
+	}
+	#if defined(USART1_ENABLED)
+	if (chan == CHAN_UART1 || chan == CHAN_ALL){
+		uart1_puts_p(progmem_s);
+	}
+	#endif
+}
+
+
+/*************************************************************************
+Function: chan_putc(), chan_puts(), chan_puts_p()
+Purpose:  transmit a character or string to the channel in cmd_chan
+Input:    character or string to be transmitted
+Returns:  none
+**************************************************************************/
+void chan_putc(char c){
+	chan_putc_to(cmd_chan, c);
+}
+
+void chan_puts(const char *s){
+	chan_puts_to(cmd_chan, s);
+}
+
+void chan_puts_p(const char *progmem_s){
+	chan_puts_p_to(cmd_chan, progmem_s);
+}
+
+
+/*************************************************************************
+Function: chan_putc_lp()
+Purpose:  transmit a low priority character to the channel in cmd_chan,
+		  it is dropped if the transmit buffer is full
+Input:    character to be transmitted
+Returns:  none
+**************************************************************************/
+void chan_putc_lp(char c){
+	if (cmd_chan == CHAN_UART0 || cmd_chan == CHAN_ALL){
+		uart0_putc_lp(c);
+	}
+	#if defined(USART1_ENABLED)
+	if (cmd_chan == CHAN_UART1 || cmd_chan == CHAN_ALL){
+		uart1_putc_lp(c);
+	}
+	#endif
+}
+
+
+/*************************************************************************
+Function: chan_tx_free()
+Purpose:  free transmit buffer space of the channel in cmd_chan
+		  (smallest of all channels for CHAN_ALL)
+Returns:  number of free bytes
+**************************************************************************/
+uint16_t chan_tx_free(void){
+	uint16_t ret = 0xFFFF;
+
+	if (cmd_chan == CHAN_UART0 || cmd_chan == CHAN_ALL){
+		ret = uart0_tx_free();
+	}
+	#if defined(USART1_ENABLED)
+	if ( (cmd_chan == CHAN_UART1 || cmd_chan == CHAN_ALL) && (uart1_tx_free() < ret) ){
+		ret = uart1_tx_free();
+	}
+	#endif
+	return ret;
+}
+
+
+/*************************************************************************
+Function: bcast_puts(), bcast_puts_p(), bcast_puts_lp()
+Purpose:  transmit an asynchronous event message to all channels,
+		  bcast_puts_lp() drops the message on channels without space
+Input:    string to be transmitted
+Returns:  bcast_puts_lp(): UART_TX_WOULDBLOCK if it was dropped on any channel
+**************************************************************************/
+void bcast_puts(const char *s){
+	chan_puts_to(CHAN_ALL, s);
+}
+
+void bcast_puts_p(const char *progmem_s){
+	chan_puts_p_to(CHAN_ALL, progmem_s);
+}
+
+uint8_t bcast_puts_lp(const char *s){
+	uint8_t ret;
+
+	ret = uart0_puts_lp(s);
+	#if defined(USART1_ENABLED)
+	ret |= uart1_puts_lp(s);
+	#endif
+	return ret;
+}
@@ -20,30 +20,104 @@
 #define  GET_LN_RECEIVED	0
 
 #define  LINE_DELIMITER		'\r'	
+#define  PIPE_SEPARATOR		';'		//Separates several commands in one line
+#define  PIPE_PREEMPT		'!'		//Prefix: queued command does not wait for the end of a motion
+#define  REQ_TAG			'#'		//Optional request tag at the end of a command, e.g. "setvol 30 #12"
+
+//cmd_parser() return values
+#define  CMD_OK				0
+#define  CMD_ERR_PARSE		1		//Unknown command or invalid arguments, the command function was not called
+#define  CMD_ERR_REJECTED	2		//The command function rejected its arguments (cmd_reject)
 #define  LINE_BUF_SIZE		40		
 #define	 CMD_SEPARATORS		" ,"	//For strtok
 
-extern char uart0_line_buf[];
+//Command channels, every channel has its own line buffer
+#define  CHAN_UART0			0		//ESP8266 WiFi bridge
+#define  CHAN_UART1			1		//External connector
+#if defined(USART1_ENABLED)
+	#define  NUM_CHANS		2
+#else
+	#define  NUM_CHANS		1
+#endif
+#define  CHAN_ALL			0xFF	//All channels (IR commands, asynchronous events)
+#define  CHAN_NONE			0xFE	//No text output (binary frame commands)
+
+//Binary command frames: SYNC | OPCODE | LEN | PAYLOAD | CRC8
+//OPCODE is the CMD_IDX_* of the command, PAYLOAD are LEN/2 numeric arguments
+//(uint16, little endian), CRC8 is _crc8_ccitt_update() over OPCODE, LEN and PAYLOAD.
+//A frame is detected by the SYNC byte at the beginning of a line.
+//Reply: SYNC | OPCODE|FRAME_REPLY | 3 | STATUS | ADC_L | ADC_H | CRC8
+#define  FRAME_SYNC			0xA5
+#define  FRAME_REPLY		0x80	//Set in the opcode of reply frames
+#define  FRAME_MAX_PAYLOAD	(2*MAX_NUM_ARG)
+#define  FRAME_TIMEOUT_MS	50		//ms, maximum gap between two bytes of a frame
+#define  FRAME_OP_NONE		0xFF	//Received line was a text line
+
+#define  FRAME_STAT_OK		0		//Command executed
+#define  FRAME_STAT_ERR		1		//Command rejected by the parser
+#define  FRAME_STAT_CRC		2		//CRC mismatch, frame dropped
+#define  FRAME_STAT_FORMAT	3		//Invalid opcode or length, frame dropped
+#define  FRAME_STAT_REJECT	4		//Arguments rejected by the command (cmd_reject)
+
+extern char chan_line_buf[NUM_CHANS][LINE_BUF_SIZE];
+extern uint8_t chan_frame_op[NUM_CHANS];
+extern uint8_t cmd_chan;
+extern uint8_t cmd_src_chan;
 
 /**
  *  @brief   Parses the string in cmd for arguments and valid commands
  *           calls the matching command function with arguments
- *  @return  0 - if no error occured; 1 if a error occured
+ *  @return  CMD_OK; CMD_ERR_PARSE if the parser found an error;
+ *           CMD_ERR_REJECTED if the command function rejected its arguments
  */
 uint8_t cmd_parser(char* cmd);
 
+/**
+ *  @brief   Reports an error of a command function to cmd_chan and marks
+ *           the command as rejected
+ */
+void cmd_reject(const char *progmem_s);
+
 
 /**
- *  @brief   Reads a line from receive buffer
- *  @return  String containing the read line
+ *  @brief   Reads a line from the receive buffer of a channel into chan_line_buf[chan]
+ *  @return  GET_LN_RECEIVED if a complete line was read
  */
-uint16_t uart0_getln(char* uart0_line_buf);
+uint16_t chan_getln(uint8_t chan);
 
 /**
  *  @brief   Checks the upper 16 bits of rec_val for error flags
+ *           and reports them to the channel
  *  @return  16Bit UART error code
  */
-uint16_t uart0_errchk(uint16_t rec_val);
+uint16_t chan_errchk(uint8_t chan, uint16_t rec_val);
+
+/**
+ *  @brief   Output functions routed to the channel in cmd_chan
+ *           (the channel of the command which is processed)
+ */
+void chan_putc(char c);
+void chan_puts(const char *s);
+void chan_puts_p(const char *progmem_s);
+void chan_putc_lp(char c);
+uint16_t chan_tx_free(void);
+
+/**
+ *  @brief   Sends a binary frame with payload to a channel
+ */
+void frame_send(uint8_t chan, uint8_t opcode, const uint8_t *payload, uint8_t len);
+
+/**
+ *  @brief   Sends a binary reply frame with status and the current adc value
+ */
+void frame_reply(uint8_t chan, uint8_t opcode, uint8_t status);
+
+/**
+ *  @brief   Output functions for asynchronous events, sent to all channels
+ */
+void bcast_puts(const char *s);
+void bcast_puts_p(const char *progmem_s);
+uint8_t bcast_puts_lp(const char *s);
 
 /**
  *  @brief   peeks if the string in buffer is volume control command
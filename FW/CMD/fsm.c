@@ -3,8 +3,10 @@
  *
  * Implements a finite-state-machine which controlles
  * the ALPS motor potentiometer all "not volume control command" gets
- * executed right away. The volume control commands "setvol, volup, voldown" changes
- * the states in the fsm. For a visual representation of the fsm refer to github
+ * executed right away. The volume control commands "setvol, volup, voldown" post
+ * motion requests to the fsm. The fsm is a transition table of (state, event) ->
+ * (action, next state) with a single dispatcher. For a visual representation of
+ * the fsm refer to github
  *
  * Created: 08.07.2019 22:31:15
  *  Author: Tobias Ammann
@@ -14,10 +16,11 @@
 #include "../UART/uart.h"
 #include "cmdparser.h"
 #include "cmd.h"
+#include "fsm_table.h"
 #include "../IMRP/irmp.h"
 #include <inttypes.h>
-#include <util/atomic.h>
 #include "stdlib.h"
+#include <avr/pgmspace.h>
 
 static int adc_run_dist;
 static uint8_t tmp;
@@ -30,8 +33,101 @@ static uint8_t keyset_idx_tmp;
 static uint8_t cmd_idx_tmp_stat;
 
 
+static uint16_t ramp_start_pct8;
+static uint16_t ramp_start_ms;
+static uint16_t ramp_elapsed;
+static uint16_t ramp_sp;
+static uint8_t ramp_up;
+
 static uint8_t CMD_REC_UART = 0;
 static uint8_t CMD_REC_IR = 0;
+static uint8_t uart_line_chan = CHAN_UART0;	//Channel of the received UART line
+static uint8_t frame_pending = FALSE;		//Received UART line was a binary frame, reply outstanding
+static uint8_t frame_stat;					//Parser status of the UART command (reply frame, tag event)
+
+static char pipe_buf[LINE_BUF_SIZE];		//Received line, the ';' separated commands are split by NUL
+static uint8_t pipe_pos = 0;				//Start of the next queued command in pipe_buf
+static uint8_t pipe_len = 0;				//Length of the line in pipe_buf, 0 if the queue is empty
+static char *uart_line = pipe_buf;			//UART command which is processed
+static uint16_t uart_line_tag = 0;			//Request tag of uart_line, 0 if not tagged
+
+static uint16_t motion_tag = 0;				//Request tag of the active motion, 0 if not tagged
+static uint8_t motion_chan;					//Channel of the tagged motion command
+static uint16_t motion_ms;					//Start time of the tagged motion
+static uint8_t motion_result = MOTION_DONE;	//Result of the motion, set where the motion ends
+static uint8_t motion_replaced = FALSE;		//Motion was retriggered by a new volume command
+
+#if STATS_ENABLED
+	static stats_stamp cmd_rx_stamp;		//Reception of the UART line
+	static stats_stamp ir_stamp;			//Reception of the IR frame
+	static stats_stamp settle_stamp;		//Start of the setvol motion
+	static uint8_t ir_motor_wait = FALSE;	//IR frame received, motor start not yet seen
+	static uint8_t settle_run = FALSE;		//setvol motion active
+#endif
+
+//Detects manual knob turns while the motor is off and sends a rate limited
+//"vol <pct>" notification, connected clients do not have to poll getadcval
+static void knob_monitor(uint16_t adc, uint8_t idle){
+	static uint16_t knob_pct8_ref;		//Last reported position (or position at motor stop)
+	static uint16_t knob_idle_ms;		//Time the motor stopped
+	static uint16_t knob_move_ms;		//Time the position left the hysteresis band
+	static uint16_t knob_ntf_ms;		//Time of the last notification
+	static uint16_t knob_adc = 0;		//adc value of knob_pct8
+	static uint16_t knob_pct8 = 0;		//Current position in percent
+	static uint8_t knob_moving = FALSE;
+	static uint8_t knob_idle = FALSE;
+
+	uint16_t now = sys_ms_get();
+	char buffer[10];
+
+	//Invert the pot curve only for a new adc value
+	if (adc != knob_adc){
+		knob_adc = adc;
+		knob_pct8 = adc_to_pct8(adc);
+	}
+
+	if (!idle || !knob_idle){
+		//Motor active or just stopped -> follow the position without notification
+		knob_idle = idle;
+		knob_idle_ms = now;
+		knob_moving = FALSE;
+		knob_pct8_ref = knob_pct8;
+		return;
+	}
+
+	if ((uint16_t) (now - knob_idle_ms) < KNOB_SETTLE_MS){
+		//Wait until the motor coasted out and the idle adc rate is active
+		knob_pct8_ref = knob_pct8;
+		return;
+	}
+
+	if (abs((int16_t) (knob_pct8 - knob_pct8_ref)) < KNOB_HYST_PCT8){
+		knob_moving = FALSE;
+		return;
+	}
+
+	//Debounce the position change
+	if (!knob_moving){
+		knob_moving = TRUE;
+		knob_move_ms = now;
+		return;
+	}
+	if ( ((uint16_t) (now - knob_move_ms) < KNOB_DEBOUNCE_MS) ||
+	((uint16_t) (now - knob_ntf_ms) < KNOB_NOTIFY_MS) ){
+		return;
+	}
+
+	//Notify the new volume (rounded percent)
+	knob_pct8_ref = knob_pct8;
+	knob_ntf_ms = now;
+	knob_moving = FALSE;
+
+	//Unsolicited output must not block the main loop -> low priority
+	strcpy_P(buffer, PSTR("vol "));
+	utoa((knob_pct8 + 0x80) >> 8, buffer + 4, 10);
+	strcat_P(buffer, PSTR("\r\n"));
+	bcast_puts_lp(buffer);
+}
 
 //Retuns the CMD index of the received IR Command
 void get_ir_cmd_idx(IRMP_DATA irmp_tmp_dat, uint8_t* cmd_idx_stat, uint8_t* cmd_idx, uint8_t* keyset_idx){
@@ -55,360 +151,650 @@ void get_ir_cmd_idx(IRMP_DATA irmp_tmp_dat, uint8_t* cmd_idx_stat, uint8_t* cmd_
 	*cmd_idx = 0xFF;
 }
 
-//Checks for a new command while a volup or voldown cmd is active
-void check_for_new_cmds_volupdown_act(void){
+//Sends the completion event of a tagged command to the channel of the command
+//"done <id> <adc> <elapsed_ms>" or "fail <id> <reason>"
+static void motion_event(uint8_t chan, uint16_t tag, uint8_t result){
+	char buffer[6];
+	uint8_t chan_tmp = cmd_chan;
+
+	cmd_chan = chan;
+	chan_puts_p( (result == MOTION_DONE) ? PSTR("done ") : PSTR("fail ") );
+	chan_puts(utoa(tag, buffer, 10));
+	chan_putc(' ');
+
+	switch (result){
+		case MOTION_DONE:
+			//10 bit adc value as returned by getadcval
+			chan_puts(utoa(adc_val_fsm >> ADC_EXTRA_BITS, buffer, 10));
+			chan_putc(' ');
+			chan_puts(utoa(sys_ms_get() - motion_ms, buffer, 10));
+			break;
+		case MOTION_FAIL_LIMIT:		chan_puts_p(PSTR("limit")); break;
+		case MOTION_FAIL_SEARCH:	chan_puts_p(PSTR("search")); break;
+		case MOTION_FAIL_FAULT:		chan_puts_p(PSTR("fault")); break;
+		case MOTION_FAIL_ABORT:		chan_puts_p(PSTR("abort")); break;
+		case MOTION_FAIL_REPLACED:	chan_puts_p(PSTR("replaced")); break;
+		case MOTION_FAIL_DROPPED:	chan_puts_p(PSTR("dropped")); break;
+		default:					chan_puts_p(PSTR("error")); break;
+	}
+	chan_puts_p(PSTR("\r\n"));
+	cmd_chan = chan_tmp;
+}
+
+//Queues a received line, the commands are split at PIPE_SEPARATOR
+//Commands of a previous line which are still queued are dropped, tagged ones
+//get a "fail <id> dropped" event on the channel of their line
+static void pipe_load(char *line){
+	char *tag;
+
+	while (pipe_pos < pipe_len){
+		tag = strchr(&pipe_buf[pipe_pos], REQ_TAG);
+		if ( (tag != NULL) && atol(tag + 1) ){
+			motion_event(uart_line_chan, atol(tag + 1), MOTION_FAIL_DROPPED);
+		}
+		pipe_pos += strlen(&pipe_buf[pipe_pos]) + 1;
+	}
+
+	strcpy(pipe_buf, line);
+	pipe_len = strlen(pipe_buf);
+	pipe_pos = 0;
+
+	for (uint8_t i = 0; i < pipe_len; i++){
+		if (pipe_buf[i] == PIPE_SEPARATOR){
+			pipe_buf[i] = 0;
+		}
+	}
+}
+
+//Sets uart_line to the next queued command, returns FALSE if there is none
+//The first command of a line is executed right away (as a single command). Later
+//commands wait until the fsm is back in STATE_INIT (no motion active), unless
+//they are prefixed with PIPE_PREEMPT
+static uint8_t pipe_next(void){
+	char *cmd;
+
+	while (pipe_pos < pipe_len){
+		cmd = &pipe_buf[pipe_pos];
+
+		//Skip leading blanks and empty commands
+		while (*cmd == ' '){
+			cmd++;
+		}
+		if (*cmd == 0){
+			pipe_pos += strlen(&pipe_buf[pipe_pos]) + 1;
+			continue;
+		}
+
+		if (*cmd == PIPE_PREEMPT){
+			cmd++;
+		}
+		else if ( (pipe_pos != 0) && (FSM_STATE != STATE_INIT) ){
+			//Wait for the end of the motion
+			return FALSE;
+		}
+
+		uart_line = cmd;
+		pipe_pos += strlen(&pipe_buf[pipe_pos]) + 1;
+
+		//Optional request tag at the end of the command
+		uart_line_tag = 0;
+		cmd = strchr(uart_line, REQ_TAG);
+		if (cmd != NULL){
+			*cmd = 0;
+			uart_line_tag = atol(cmd + 1);
+		}
+		return TRUE;
+	}
+
+	//All commands executed
+	pipe_len = 0;
+	return FALSE;
+}
+
+//Tracks tagged commands and emits their completion events, called once at
+//the end of every fsm pass. Every path which ends a motion goes to STATE_INIT
+//and sets motion_result, so this is the only place which reports completion.
+static void motion_track(uint8_t uart_consumed){
+	//Tagged motion ended or was retriggered
+	if (motion_tag){
+		if (motion_replaced){
+			motion_event(motion_chan, motion_tag, MOTION_FAIL_REPLACED);
+			motion_tag = 0;
+		}
+		else if (FSM_STATE == STATE_INIT){
+			motion_event(motion_chan, motion_tag, motion_result);
+			motion_tag = 0;
+		}
+	}
+	motion_replaced = FALSE;
+
+	//Tagged command executed in this pass
+	if (uart_consumed && uart_line_tag){
+		motion_chan = uart_line_chan;
+		motion_ms = sys_ms_get();
+		motion_result = MOTION_DONE;
+
+		if (frame_stat != FRAME_STAT_OK){
+			//Rejected by the parser or the command (cmd_reject)
+			motion_event(motion_chan, uart_line_tag, MOTION_FAIL_ERROR);
+		}
+		else if (FSM_STATE == STATE_INIT){
+			//No motion (other command or target already reached)
+			motion_event(motion_chan, uart_line_tag, MOTION_DONE);
+		}
+		else {
+			motion_tag = uart_line_tag;
+		}
+		uart_line_tag = 0;
+	}
+}
+
+static uint8_t fsm_fault = MOTOR_FAULT_NONE;	//Result of the motor monitor in this pass
+static uint8_t fsm_req = EV_NONE;				//Motion request of a command handler
+
+//Returns TRUE if the event has a transition in the current state
+static uint8_t fsm_handles(uint8_t ev){
+	return pgm_read_byte(&fsm_table[FSM_STATE][ev]) != T_IGN;
+}
+
+//Rotation direction of the active motion: TRUE for cw (volume up)
+static uint8_t fsm_dir_up(void){
+	switch (FSM_STATE){
+		case STATE_VOLUP:
+		case STATE_VOLUP_ACT:
+			return TRUE;
+		case STATE_SETVOL_RAMP_ACT:
+			return ramp_up;
+		default:
+			return FALSE;
+	}
+}
+
+//Classifies the received command, a UART command is processed before an IR command
+static uint8_t fsm_cmd_event(void){
 	char line_buf_tmp[LINE_BUF_SIZE];
-	
-	if (CMD_REC_IR){
-		//IR-Commands
+
+	if (CMD_REC_UART){
+		//make a copy of uart line buffer, peek_volctrl modifies the string
+		strcpy(line_buf_tmp, uart_line);
+		cmd_idx_tmp = peek_volctrl(line_buf_tmp);
+	}
+	else {
 		get_ir_cmd_idx(irmp_data, &cmd_idx_tmp_stat, &cmd_idx_tmp, &keyset_idx_tmp);
-		
-		if (cmd_idx_tmp_stat){
-			if (cmd_idx_tmp == CMD_IDX_VOLUP){
-				FSM_STATE = STATE_VOLUP;
-				CMD_REC_IR = 0;
-				return;
-			}
-			else if (cmd_idx_tmp == CMD_IDX_VOLDOWN){
-				FSM_STATE = STATE_VOLDOWN;
-				CMD_REC_IR = 0;
-				return;
-			}
+	}
+
+	switch (cmd_idx_tmp){
+		case CMD_IDX_VOLUP:		return EV_CMD_VOLUP;
+		case CMD_IDX_VOLDOWN:	return EV_CMD_VOLDOWN;
+		case CMD_IDX_SETVOL:	return EV_CMD_SETVOL;
+		default:				return EV_CMD_OTHER;
+	}
+}
+
+//Detects the event of this pass in priority order. Only events with a transition
+//in the current state are detected: the increment timer expiry is only consumed
+//in the *_ACT states, received commands wait while an entry state is active
+static uint8_t fsm_event(void){
+	uint8_t ev;
+
+	if (fsm_fault != MOTOR_FAULT_NONE){
+		return EV_FAULT;
+	}
+
+	if ( fsm_handles(EV_LIMIT) &&
+	(chk_adc_range(adc_val_fsm) == (fsm_dir_up() ? ADC_POT_STAT_HI : ADC_POT_STAT_LO)) ){
+		return EV_LIMIT;
+	}
+
+	if ( fsm_handles(EV_INC_EXP) && tmr_expired(TMR_INC) ){
+		return EV_INC_EXP;
+	}
+
+	adc_run_dist = adc_val_fsm - setvol_targ;
+	if ( fsm_handles(EV_TARGET) && (abs(adc_run_dist) < SETVOL_TOL) ){
+		//Check this first: a target within the tolerance is no search error
+		return EV_TARGET;
+	}
+	if ( fsm_handles(EV_PASSED) &&
+	( ((adc_run_dist > 0) && (get_motor_stat() != MOTOR_STAT_CCW)) ||
+	((adc_run_dist < 0) && (get_motor_stat() != MOTOR_STAT_CW)) ) ){
+		return EV_PASSED;
+	}
+
+	if ( fsm_handles(EV_RAMP_END) && ((uint16_t) (sys_ms_get() - ramp_start_ms) >= setvol_ramp_dur) ){
+		return EV_RAMP_END;
+	}
+
+	if (CMD_REC_UART || CMD_REC_IR){
+		ev = fsm_cmd_event();
+		if (fsm_handles(ev)){
+			return ev;
 		}
-		
-		//The Received Command was not a volup or voldown command
-		//->No retrigger
-		inc_timer_stop();
-		set_motor_off();
-		FSM_STATE = STATE_INIT;
 	}
-		
+	return EV_NONE;
+}
+
+//Marks the received command (see fsm_cmd_event) as processed
+static void fsm_cmd_done(void){
 	if (CMD_REC_UART){
-		//UART
-		//make a copy of uart line buffer, peek_volctrl modifies the string
-		strcpy(line_buf_tmp, uart0_line_buf);
-		tmp = peek_volctrl(line_buf_tmp);
-		if (tmp == CMD_IDX_VOLUP){
-			FSM_STATE = STATE_VOLUP;
-			CMD_REC_UART = 0;
-			return;
+		CMD_REC_UART = 0;
+	}
+	else {
+		CMD_REC_IR = 0;
+	}
+}
+
+static uint8_t act_none(void){
+	return TRUE;
+}
+
+static uint8_t act_cmd_exec(void){
+	//A setvol during a search or ramp retriggers the motion, setvolume() coalesces the target
+	if (FSM_STATE != STATE_INIT){
+		motion_replaced = TRUE;
+	}
+
+	if (CMD_REC_UART){
+		#if STATS_ENABLED
+			stats_lat_add(&st.cmd_lat, stats_elapsed_us(&cmd_rx_stamp));
+		#endif
+
+		//Call CMD parser
+		switch (cmd_parser(uart_line)){
+			case CMD_ERR_PARSE:		frame_stat = FRAME_STAT_ERR; break;
+			case CMD_ERR_REJECTED:	frame_stat = FRAME_STAT_REJECT; break;
+			default: break;
 		}
-		else if (tmp == CMD_IDX_VOLDOWN){
-			FSM_STATE = STATE_VOLDOWN;
-			CMD_REC_UART = 0;
-			return;
+		CMD_REC_UART = 0;
+		return TRUE;
+	}
+
+	#if DEBUG_MSG
+		char buf[10];
+		chan_puts_p(PSTR("protocol: 0x"));
+		itoh (buf, 2, irmp_data.protocol);
+		chan_puts(buf);
+		
+		chan_puts_p(PSTR("   address: 0x"));
+		itoh (buf, 4, irmp_data.address);
+		chan_puts(buf);
+		
+		chan_puts_p(PSTR("   command: 0x"));
+		itoh (buf, 4, irmp_data.command);
+		chan_puts(buf);
+		
+		chan_puts_p(PSTR("   flags: 0x"));
+		itoh (buf, 2, irmp_data.flags);
+		chan_puts(buf);
+		chan_puts_p(PSTR("\r\n"));
+	#endif
+
+	//IR key of the keyset (found by fsm_cmd_event)
+	if (cmd_idx_tmp_stat){
+		//Build cmd string
+		strcpy(tmp_cmd_str, cmd_set[cmd_idx_tmp].cmd_word);
+		strcat(tmp_cmd_str, ir_keyset[keyset_idx_tmp].arg_str);
+		
+		//Pass the data to cmd parser, the commands post their motion request
+		cmd_parser(tmp_cmd_str);
+	}
+	#if STATS_ENABLED
+	else {
+		st.ir_unknown++;
+	}
+	#endif
+	CMD_REC_IR = 0;
+	return TRUE;
+}
+
+static uint8_t act_cmd_drop(void){
+	#if STATS_ENABLED
+		if (!CMD_REC_UART){
+			st.ir_ignored++;
 		}
-		//The Received Command was not a volup or voldown command
-		//->No retrigger
-		inc_timer_stop();
-		set_motor_off();
-		FSM_STATE = STATE_INIT;
+	#endif
+	fsm_cmd_done();
+	return TRUE;
+}
+
+static uint8_t act_cmd_retrig(void){
+	//The next state restarts the increment timer, the command handler is not called
+	motion_replaced = TRUE;
+	fsm_cmd_done();
+	return TRUE;
+}
+
+static uint8_t act_abort(void){
+	//The command stays pending and is processed in STATE_INIT
+	inc_timer_stop();
+	set_motor_off();
+	motion_result = MOTION_FAIL_ABORT;
+	return TRUE;
+}
+
+static uint8_t act_fault(void){
+	set_motor_off();
+	inc_timer_stop();
+	motion_result = MOTION_FAIL_FAULT;
+	log_motor_fault(fsm_fault);
+	return TRUE;
+}
+
+static uint8_t act_limit(void){
+	if (fsm_dir_up()){
+		chan_puts_p(PSTR("Motor @ upper lim.!\r\n"));
+	}
+	else {
+		chan_puts_p(PSTR("Motor @ lower lim.!\r\n"));
+	}
+	motion_result = MOTION_FAIL_LIMIT;
+	inc_timer_stop();
+	set_motor_off();
+	return TRUE;
+}
+
+static uint8_t act_stop(void){
+	set_motor_off();
+
+	#if STATS_ENABLED
+		//setvol target reached
+		if (settle_run && ((FSM_STATE == STATE_SETVOL) || (FSM_STATE == STATE_SETVOL_ACT))){
+			stats_lat_add(&st.settle, sys_ms_get() - settle_stamp.ms);
+		}
+	#endif
+	return TRUE;
+}
+
+static uint8_t act_search_err(void){
+	set_motor_off();
+	TRACE(TRC_ERROR, TRC_ERR_SEARCH);
+	chan_puts_p(PSTR("Volume search error!\r\n"));
+	motion_result = MOTION_FAIL_SEARCH;
+	error_led(TRUE);
+	return TRUE;
+}
+
+//VOLUP and VOLDOWN, the direction follows from the state
+static uint8_t act_step_start(void){
+	uint8_t up = fsm_dir_up();
+
+	if (!tmr_running(TMR_INC)){
+		//Timer not running
+		inc_timer_start();
+
+		if ( get_motor_stat() != MOTOR_STAT_OFF ){
+			//ERROR: running motor without a timer is not allowed. Turn on error indicator LED
+			TRACE(TRC_ERROR, TRC_ERR_NO_TIMER);
+			error_led(TRUE);
+			set_motor_off();
+		}
+	}
+	else {
+		//Timer already running (e.g from a previous volup or voldown cmd)
+		inc_timer_rst(); // restart timer
+	}
+
+	//Rotation direction is unknown, here -> handled in set_motor_cw()/set_motor_ccw()
+	if (up){
+		set_motor_cw();
+	}
+	else {
+		set_motor_ccw();
+	}
+
+	//Motor held off by the dead time -> retry in the next pass
+	return get_motor_stat() == (up ? MOTOR_STAT_CW : MOTOR_STAT_CCW);
+}
+
+static uint8_t act_seek_start(void){
+	//Get correct rotation direction
+	if (adc_val_fsm < setvol_targ) {
+		set_motor_cw();
+	}
+	else{
+		set_motor_ccw();
+	}
+
+	//Motor held off by the dead time (or stopped for a reversal) -> retry
+	return get_motor_stat() != MOTOR_STAT_OFF;
+}
+
+static uint8_t act_ramp_start(void){
+	ramp_start_pct8 = adc_to_pct8(adc_val_fsm);
+	ramp_start_ms = sys_ms_get();
+	ramp_up = ( ((uint16_t) setvol_ramp_pct << 8) >= ramp_start_pct8 );
+	return TRUE;
+}
+
+static uint8_t act_ramp_track(void){
+	ramp_elapsed = sys_ms_get() - ramp_start_ms;
+
+	//Current setpoint on the trajectory (interpolated in percent)
+	ramp_sp = pct8_to_adc( ramp_start_pct8 +
+	(int32_t) ( ((int16_t) setvol_ramp_pct << 8) - (int16_t) ramp_start_pct8 ) * ramp_elapsed / setvol_ramp_dur );
+
+	//Track the setpoint: run the motor while the position is behind the trajectory
+	if (ramp_up){
+		if (adc_val_fsm >= ramp_sp){
+			set_motor_pause();
+		}
+		else if (adc_val_fsm + SETVOL_RAMP_HYST <= ramp_sp){
+			set_motor_cw();
+		}
+	}
+	else {
+		if (adc_val_fsm <= ramp_sp){
+			set_motor_pause();
+		}
+		else if (adc_val_fsm >= ramp_sp + SETVOL_RAMP_HYST){
+			set_motor_ccw();
+		}
+	}
+	return TRUE;
+}
+
+//Action table, indexed by A_*
+static uint8_t (* const fsm_act[])(void) PROGMEM = {
+	act_none,		act_cmd_exec,	act_cmd_drop,	act_cmd_retrig,
+	act_abort,		act_fault,		act_limit,		act_stop,
+	act_search_err,	act_step_start,	act_seek_start,	act_ramp_start,
+	act_ramp_track
+};
+
+//Runs the action of the (state, event) pair and enters the next state
+static void fsm_dispatch(uint8_t ev){
+	uint8_t t = pgm_read_byte(&fsm_table[FSM_STATE][ev]);
+	uint8_t (*act)(void) = (uint8_t (*)(void)) pgm_read_word(&fsm_act[T_ACT(t)]);
+
+	#if STATS_ENABLED
+		//Start of a setvol motion (retriggers keep the start time)
+		if ( (FSM_STATE == STATE_INIT) && ((ev == EV_REQ_SETVOL) || (ev == EV_REQ_RAMP)) ){
+			stats_stamp_set(&settle_stamp);
+			settle_run = TRUE;
+		}
+	#endif
+
+	if (act() && (T_NEXT(t) != S_SAME) && (T_NEXT(t) != FSM_STATE)){
+		FSM_STATE = T_NEXT(t);
+		TRACE(TRC_STATE, FSM_STATE);
+	}
+}
+
+//Posts a motion request (EV_REQ_*) of a command handler, it is dispatched
+//in the same fsm pass. Command handlers do not write FSM_STATE
+void fsm_post(uint8_t ev){
+	fsm_req = ev;
+}
+
+//Returns TRUE if fsm() has to run without a new interrupt event: received
+//uart bytes, queued commands, entry states which advance in the next pass,
+//pending showrem, stats and trace output, EEPROM journal writes and queued uart output.
+//Called by the main loop with interrupts disabled
+uint8_t fsm_pending(void){
+	if ( uart1_available() || (uart0_available() && !tmr_running(TMR_BOOT)) ){
+		return TRUE;
+	}
+	//Journal writes and the tasks waiting for the end of the output must not depend on ADC wake ups
+	if ( ee_busy() || uart0_tx_busy() || uart1_tx_busy() ){
+		return TRUE;
+	}
+	if (CMD_REC_UART || CMD_REC_IR || showrem_busy() || stats_busy()){
+		return TRUE;
+	}
+	#if TRACE_ENABLED
+		if (trace_busy()){
+			return TRUE;
+		}
+	#endif
+	//Queued commands wait for STATE_INIT, the motion wakes the fsm until then
+	if (pipe_len && (FSM_STATE == STATE_INIT)){
+		return TRUE;
+	}
+	switch (FSM_STATE){
+		case STATE_VOLUP:
+		case STATE_VOLDOWN:
+		case STATE_SETVOL:
+		case STATE_SETVOL_RAMP:
+			//The end of the motor dead time is a timer event
+			return !tmr_running(TMR_MOTOR_DEAD);
+		default:
+			return FALSE;
 	}
 }
 
 //FINITE-STATE-MACHINE
 void fsm (void){
+	uint8_t uart_pending;
+	uint8_t ir_rx;
+
+	PROBE_ON(PRB_FSM);
+
 
 	//adc_run_dist = 0;
-	char line_buf_tmp[LINE_BUF_SIZE];
 	
-	//Check uart for new messages
-	if (uart0_getln(uart0_line_buf) == GET_LN_RECEIVED){
-		//got a command via UART (WiFi)
+	//Check both uart channels for new messages, one line per pass
+	//The channels are also read while queued commands wait for the end of a
+	//motion, a new line drops the rest of the queue (like a new single command)
+	for (tmp = 0; (tmp < NUM_CHANS) && !CMD_REC_UART; tmp++){
+		//UART0 is ignored until the boot message of the ESP8266 has passed
+		if ( (tmp == CHAN_UART0) && tmr_running(TMR_BOOT) ){
+			continue;
+		}
+		if (chan_getln(tmp) == GET_LN_RECEIVED){
+			//got a command via UART0 (WiFi) or UART1 (external connector)
+			#if STATS_ENABLED
+				stats_stamp_set(&cmd_rx_stamp);
+			#endif
+			pipe_load(chan_line_buf[tmp]);
+			uart_line_chan = tmp;
+
+			//Binary frame: reply with a status frame instead of text
+			frame_pending = (chan_frame_op[tmp] != FRAME_OP_NONE);
+		}
+	}
+
+	//Next queued command of the line
+	if (!CMD_REC_UART && pipe_next()){
 		CMD_REC_UART = TRUE;
+		frame_stat = FRAME_STAT_OK;
 	}
+	uart_pending = CMD_REC_UART;
 
-	//Check IRMP for new messages
-	if (irmp_get_data (&irmp_data)){
+	//Check IRMP for new messages, a pending regrem takes the next key
+	ir_rx = irmp_get_data (&irmp_data);
+	if (ir_rx && !regrem_busy()){
 		// got an IR message
 		CMD_REC_IR = TRUE;
+		#if STATS_ENABLED
+			st.ir_decoded++;
+			stats_stamp_set(&ir_stamp);
+			ir_motor_wait = TRUE;
+		#endif
 	}
 
-	//Get current adc value for poti position reading
-	ATOMIC_BLOCK(ATOMIC_FORCEON){
-		adc_val_fsm =   adc_val;
-	  }
-	
-	
-	switch ( FSM_STATE ) {
-		case STATE_INIT:
-		//Init State, do nothing (wait for commands)
-			
-		//Wait for UART-commands
-		if (CMD_REC_UART) {
-			//Call CMD parser
-			cmd_parser(uart0_line_buf);
-			CMD_REC_UART = 0;
-		}
+	//Responses go back to the channel of the command, IR commands are answered on all channels
+	if (CMD_REC_UART){
+		cmd_chan = frame_pending ? CHAN_NONE : uart_line_chan;
+		cmd_src_chan = uart_line_chan;
+	}
+	else if (CMD_REC_IR){
+		cmd_chan = CHAN_ALL;
+		cmd_src_chan = CHAN_ALL;
+	}
 
-		if (CMD_REC_IR){
-			#if DEBUG_MSG
-				char buf[10];
-				uart0_puts_p(PSTR("protocol: 0x"));
-				itoh (buf, 2, irmp_data.protocol);
-				uart0_puts(buf);
-				
-				uart0_puts_p(PSTR("   address: 0x"));
-				itoh (buf, 4, irmp_data.address);
-				uart0_puts(buf);
-				
-				uart0_puts_p(PSTR("   command: 0x"));
-				itoh (buf, 4, irmp_data.command);
-				uart0_puts(buf);
-				
-				uart0_puts_p(PSTR("   flags: 0x"));
-				itoh (buf, 2, irmp_data.flags);
-				uart0_puts(buf);
-				uart0_puts_p(PSTR("\r\n"));
-			#endif
-				
-			//if (irmp_data.flags == 1) {
-				////Ignore repetitive keypresses
-				////Only the first button press should trigger a
-				////Command it is possible that a button was pressed to stop the setvol command. If the remote sends a second ir comannd (with flag == 1)
-				////it should not trigger a cmd
-				//CMD_REC_IR = 0;
-				//break;
-			//}
-
-			//Check if the received IR-Command matches a key in the keyset
-			ir_key_tmp.ir_addr =  irmp_data.address;
-			ir_key_tmp.ir_cmd = irmp_data.command;
-			ir_key_tmp.ir_prot = irmp_data.protocol;
-			
-			for (int i = 0; i < ir_keyset_len; i++){
-				
-				if ( memcmp( (void*) &(ir_key_tmp), (void*) &(ir_keyset[i].key_data), sizeof(ir_key_data)) == 0){
-					//Valid key found!
-
-					//Build cmd string
-					strcpy(tmp_cmd_str, cmd_set[ir_keyset[i].cmd_idx].cmd_word);
-					strcat(tmp_cmd_str, ir_keyset[i].arg_str);
-					
-					//Pass the data to cmd parser
-					cmd_parser(tmp_cmd_str);
-					//THe commands will handle the FSM_STATE Variable
-				}
-			}
-			CMD_REC_IR = 0;
-		}
-		break;
-			
-		case STATE_VOLUP:
-		//Check if the Motor is at the upper (right) limit
-		if (chk_adc_range(adc_val_fsm) == ADC_POT_STAT_HI){
-			//Motor potentiometer is at right limit
-			uart0_puts_p(PSTR("Motor @ upper lim.!\r\n"));
-			
-			//Do not turn the Motor on
-			//Stop timers go to init
-			FSM_STATE = STATE_INIT;
+	//Get current adc value for poti position reading (without disabling interrupts)
+	adc_val_fsm = adc_val_get();
 
-			inc_timer_stop();
-			set_motor_off();
-			break;
-		}
-			
-		if (inc_timer_stat == FALSE){
-			//Timer not running
-			inc_timer_start();
-				
-			//Start motor if it is not already running
-			if ( get_motor_stat() == MOTOR_STAT_OFF ){
-				set_motor_cw();		//Start motor in cw direction (volup)
-				} else {
-				//ERROR: running motor without a timer is not allowed. Turn on error indicator LED
-				error_led(TRUE);
-				set_motor_off();
-			}
-		}
-		else {
-			//Timer already running (e.g from a previous volup or voldown cmd)
-			inc_timer_rst(); // restart timer
-				
-			//Rotation direction is unknown, here -> handled in set_motor_cw()
-			set_motor_cw();
-		}
-		//Go to volume up active sate
-		FSM_STATE = STATE_VOLUP_ACT;
-		break;
+	//ADC sample rate: high while the motor runs or a volume command is active
+	//Knob turns are only detected while idle
+	if ( (FSM_STATE != STATE_INIT) || (get_motor_stat() != MOTOR_STAT_OFF) ){
+		adc0_set_rate(ADC_RATE_HI);
+		knob_monitor(adc_val_fsm, FALSE);
+	}
+	else {
+		adc0_set_rate(ADC_RATE_LO);
+		knob_monitor(adc_val_fsm, TRUE);
+	}
 
-		case STATE_VOLDOWN:
-			//Check if the Motor is at the lower (left) limit
-			if (chk_adc_range(adc_val_fsm) == ADC_POT_STAT_LO){
-				//Motor potentiometer is at right limit
-				uart0_puts_p(PSTR("Motor @ lower lim.!\r\n"));
-				
-				//Do not turn the motor on
-				FSM_STATE = STATE_INIT;
-				inc_timer_stop();
-				set_motor_off();
-				break;
-			}
-			
-			if (inc_timer_stat == FALSE){
-				//Timer not running
-				inc_timer_start();
-				
-				//Start motor if it is not already running
-				if ( get_motor_stat() == MOTOR_STAT_OFF ){
-					set_motor_ccw();		//Start motor in ccw direction (voldown)
-					} else {
-					//ERROR: running motor without a timer is not allowed turn on error indicator LED
-					error_led(TRUE);
-					set_motor_off();
-				}
-			}
-			else {
-				//Timer already running (e.g from a previous volup cmd)
-				inc_timer_rst(); // restart timer
-				
-				//Rotation direction is unknown, here -> handled in set_motor_cw()
-				set_motor_ccw();
-			}
-			FSM_STATE = STATE_VOLDOWN_ACT;
-		break;
-			
-		case STATE_VOLUP_ACT:
-			//Timer stopped (time elapsed)
-			if ( !inc_timer_stat){
-				//INC-Duration exceeded
-				set_motor_off();
-				FSM_STATE = STATE_INIT;
-				break;
-			}
-			
-			//New Command Received
-			check_for_new_cmds_volupdown_act();
-			
-			//Check if the Motor reached the limit
-			if (chk_adc_range(adc_val_fsm) == ADC_POT_STAT_HI){
-				
-				uart0_puts_p(PSTR("Motor @ upper lim.!\r\n"));
-				
-				set_motor_off();
-				inc_timer_stop();
-				FSM_STATE = STATE_INIT;
-			}
-			break;
-			
-			case STATE_VOLDOWN_ACT:
-			//Timer stopped (time elapsed)
-			if ( !inc_timer_stat){
-				//INC-Duration exceeded
-				set_motor_off();
-				FSM_STATE = STATE_INIT;
-				break;
-			}
+	//Stream pending showrem table rows
+	showrem_task();
 
-			//New command received
-			check_for_new_cmds_volupdown_act();
+	//Wait for the key of a pending regrem
+	regrem_task(ir_rx);
 
-			//Check if the Motor reached the limit
-			if (chk_adc_range(adc_val_fsm) == ADC_POT_STAT_LO){
-				
-				uart0_puts_p(PSTR("Motor @ lower lim.!\r\n"));
+	//Stream pending stats report lines
+	stats_task();
 
-				set_motor_off();
-				inc_timer_stop();
-				FSM_STATE = STATE_INIT;
-			}
-		break;
-			
-		case STATE_SETVOL:
-			adc_run_dist = adc_val_fsm - setvol_targ;
-		
-			if (abs(adc_run_dist) < SETVOL_TOL) {
-					//Noting to do
-					set_motor_off();
-					FSM_STATE = STATE_INIT;
-					break;
-				}
-			
-			//Get correct rotation direction
-			if (adc_val_fsm < setvol_targ) {
-				//We have to rotate CW
-				set_motor_cw();
-			}
-			else{
-				// we have to rote CCW
-				set_motor_ccw();
-			}
-			FSM_STATE = STATE_SETVOL_ACT;
-			break;
-			
-		case STATE_SETVOL_ACT:
-			adc_run_dist = adc_val_fsm - setvol_targ;
-		
-			//Motor passed the correct value
-			if ( ((adc_run_dist > 0) && (get_motor_stat() != MOTOR_STAT_CCW)) ||
-			((adc_run_dist < 0) && (get_motor_stat() != MOTOR_STAT_CW))) {
-				set_motor_off();
-				uart0_puts_p(PSTR("Volume search error!\r\n"));
-				FSM_STATE = STATE_INIT;
-				error_led(TRUE);
+	//Send pending trace dump records
+	#if TRACE_ENABLED
+		trace_task();
+	#endif
+
+	//Append changed settings and ir keys to the EEPROM journal
+	ee_task();
+
+	//Telemetry samples
+	stream_task(adc_val_fsm);
+
+	//Baudrate fallback if a setbaud was not confirmed
+	setbaud_task();
+
+	//Motor protection: stall and runaway detection
+	fsm_fault = motor_monitor(adc_val_fsm);
+
+	//Dispatch the event of this pass, a motion request of the executed
+	//command is dispatched right after it
+	fsm_dispatch(fsm_event());
+	while (fsm_req != EV_NONE){
+		tmp = fsm_req;
+		fsm_req = EV_NONE;
+		fsm_dispatch(tmp);
+	}
+
+	#if STATS_ENABLED
+		//IR frame to motor start latency (IR commands without motion are not counted)
+		if (ir_motor_wait){
+			if (get_motor_stat() != MOTOR_STAT_OFF){
+				stats_lat_add(&st.ir_lat, stats_elapsed_us(&ir_stamp));
+				ir_motor_wait = FALSE;
 			}
-			
-			if (abs(adc_run_dist) < SETVOL_TOL) {
-				set_motor_off();
-				FSM_STATE = STATE_INIT;
-				break;
+			else if ( (FSM_STATE == STATE_INIT) && !CMD_REC_IR ){
+				ir_motor_wait = FALSE;
 			}
-			
+		}
+		if (FSM_STATE == STATE_INIT){
+			settle_run = FALSE;
+		}
+	#endif
 
-			if (CMD_REC_IR){
-				get_ir_cmd_idx(irmp_data, &cmd_idx_tmp_stat, &cmd_idx_tmp, &keyset_idx_tmp);
-				
-				if (cmd_idx_tmp_stat){
-					if (cmd_idx_tmp == CMD_IDX_VOLUP || cmd_idx_tmp == CMD_IDX_VOLDOWN){
-						//Ignore command
-						CMD_REC_IR = 0;
-					}
-					else if (cmd_idx_tmp == CMD_IDX_SETVOL){
-						//Retrigger of setvolume, possibly with a new target value
-						//execute the complete setvol cmd!
-						strcpy(tmp_cmd_str, cmd_set[cmd_idx_tmp].cmd_word);
-						strcat(tmp_cmd_str, ir_keyset[keyset_idx_tmp].arg_str);
-						
-						//Pass the data to cmd parser
-						cmd_parser(tmp_cmd_str);
-						CMD_REC_IR = 0;
-						break;
-					}
-				}
-				
-				//Other IR Command than VOLUP, VOLDOWN or SETVOl
-				//Stop motor go to init and process the cmd
-				set_motor_off();
-				FSM_STATE = STATE_INIT;
-				break;
-				
-			}
+	//Completion events of tagged commands
+	motion_track(uart_pending && !CMD_REC_UART);
 
-			if (CMD_REC_UART){
-				//UART
-				//make a copy of uart line buffer, peek_volctrl modifies the string
-				strcpy(line_buf_tmp, uart0_line_buf);
-				cmd_idx_tmp = peek_volctrl(line_buf_tmp);
-				
-				if (cmd_idx_tmp == CMD_IDX_VOLUP || cmd_idx_tmp == CMD_IDX_VOLDOWN){
-					//Dismiss command
-					CMD_REC_UART = 0;
-				} 
-				else if (cmd_idx_tmp == CMD_IDX_SETVOL){
-					//Execute Setvol CMD -> retrigger
-					cmd_parser(uart0_line_buf);
-					CMD_REC_UART = 0;
-					break;
-				}
-				
-				//Other UART Command than VOLUP or VOLDOWN
-				//Stop motor go to init and process the cmd
-				//inc_timer_stop();
-				set_motor_off();
-				FSM_STATE = STATE_INIT;
-				break;
-		}
-		default: break;
+	//Binary frame command processed -> status and position reply
+	if (frame_pending && !CMD_REC_UART){
+		frame_pending = FALSE;
+		frame_reply(uart_line_chan, chan_frame_op[uart_line_chan], frame_stat);
 	}
+
+	PROBE_OFF(PRB_FSM);
 }
\ No newline at end of file
@@ -0,0 +1,67 @@
+/*
+ * fsm_table.h
+ *
+ * Transition table of the fsm (fsm.c). The table is kept in its own header so
+ * it can be checked on the host against the behavior of the former switch
+ * (tools/fsm_table_test.c). Only included by fsm.c, the includer provides PROGMEM.
+ *
+ * Created: 19.10.2026
+ */ 
+
+#include <inttypes.h>
+#include "../volctrl.h"
+#ifndef FSM_TABLE_H_
+#define FSM_TABLE_H_
+
+/*------------------------------------------------------------------------------------------------------
+ * TRANSITION TABLE
+ * Every (state, event) pair maps to an action and a next state, packed into one byte.
+ * The action returns FALSE if it could not complete (e.g. motor held off by the dead time),
+ * the state is kept and the action is repeated in the next pass.
+ *------------------------------------------------------------------------------------------------------*/
+
+//ACTIONS
+#define A_NONE			0
+#define A_CMD_EXEC		1	//Execute the received command (cmd parser)
+#define A_CMD_DROP		2	//Dismiss the received command
+#define A_CMD_RETRIG	3	//Retrigger of volup/voldown, the command is consumed
+#define A_ABORT			4	//Stop the motion, the command is executed in STATE_INIT
+#define A_FAULT			5	//Motor protection fault
+#define A_LIMIT			6	//Potentiometer limit reached
+#define A_STOP			7	//Motion finished
+#define A_SEARCH_ERR	8	//Volume search passed the target
+#define A_STEP_START	9	//Start (or retrigger) a volume increment
+#define A_SEEK_START	10	//Start the volume search in the direction of the target
+#define A_RAMP_START	11	//Start the volume ramp at the current position
+#define A_RAMP_TRACK	12	//Track the ramp setpoint
+
+#define T(act, next)	(((act) << 4) | (next))
+#define T_ACT(t)		((t) >> 4)
+#define T_NEXT(t)		((t) & 0x0F)
+#define S_SAME			0x0F					//Keep the current state
+#define T_IGN			T(A_NONE, S_SAME)		//Event is not handled (and not detected) in this state
+
+//Transitions which are the same in all states
+#define T_FAULT			T(A_FAULT, STATE_INIT)
+#define T_REQ			T(A_NONE, STATE_VOLUP), T(A_NONE, STATE_VOLDOWN), T(A_NONE, STATE_SETVOL), T(A_NONE, STATE_SETVOL_RAMP)
+
+//Commands received during a volume search or ramp
+#define T_CMD_SETVOL	T(A_CMD_DROP, S_SAME), T(A_CMD_DROP, S_SAME), T(A_CMD_EXEC, S_SAME), T(A_ABORT, STATE_INIT)
+
+//Commands received during a volume increment
+#define T_CMD_VOLUPDOWN	T(A_CMD_RETRIG, STATE_VOLUP), T(A_CMD_RETRIG, STATE_VOLDOWN), T(A_ABORT, STATE_INIT), T(A_ABORT, STATE_INIT)
+
+static const uint8_t fsm_table[NUM_STATES][NUM_EVENTS] PROGMEM = {
+	//				NONE								FAULT	 REQ_*	LIMIT							INC_EXP					TARGET					PASSED							RAMP_END					CMD_VOLUP, CMD_VOLDOWN, CMD_SETVOL, CMD_OTHER
+	/*INIT*/		{T_IGN,								T_FAULT, T_REQ, T_IGN,							T_IGN,					T_IGN,					T_IGN,							T_IGN,						T(A_CMD_EXEC, S_SAME), T(A_CMD_EXEC, S_SAME), T(A_CMD_EXEC, S_SAME), T(A_CMD_EXEC, S_SAME)},
+	/*VOLUP*/		{T(A_STEP_START, STATE_VOLUP_ACT),	T_FAULT, T_REQ, T(A_LIMIT, STATE_INIT),			T_IGN,					T_IGN,					T_IGN,							T_IGN,						T_IGN, T_IGN, T_IGN, T_IGN},
+	/*VOLDOWN*/		{T(A_STEP_START, STATE_VOLDOWN_ACT),T_FAULT, T_REQ, T(A_LIMIT, STATE_INIT),			T_IGN,					T_IGN,					T_IGN,							T_IGN,						T_IGN, T_IGN, T_IGN, T_IGN},
+	/*SETVOL*/		{T(A_SEEK_START, STATE_SETVOL_ACT),	T_FAULT, T_REQ, T_IGN,							T_IGN,					T(A_STOP, STATE_INIT),	T_IGN,							T_IGN,						T_IGN, T_IGN, T_IGN, T_IGN},
+	/*SETVOL_ACT*/	{T_IGN,								T_FAULT, T_REQ, T_IGN,							T_IGN,					T(A_STOP, STATE_INIT),	T(A_SEARCH_ERR, STATE_INIT),	T_IGN,						T_CMD_SETVOL},
+	/*VOLUP_ACT*/	{T_IGN,								T_FAULT, T_REQ, T(A_LIMIT, STATE_INIT),			T(A_STOP, STATE_INIT),	T_IGN,					T_IGN,							T_IGN,						T_CMD_VOLUPDOWN},
+	/*VOLDOWN_ACT*/	{T_IGN,								T_FAULT, T_REQ, T(A_LIMIT, STATE_INIT),			T(A_STOP, STATE_INIT),	T_IGN,					T_IGN,							T_IGN,						T_CMD_VOLUPDOWN},
+	/*SETVOL_RAMP*/	{T(A_RAMP_START, STATE_SETVOL_RAMP_ACT), T_FAULT, T_REQ, T_IGN,						T_IGN,					T_IGN,					T_IGN,							T_IGN,						T_IGN, T_IGN, T_IGN, T_IGN},
+	/*RAMP_ACT*/	{T(A_RAMP_TRACK, S_SAME),			T_FAULT, T_REQ, T(A_LIMIT, STATE_INIT),			T_IGN,					T_IGN,					T_IGN,							T(A_NONE, STATE_SETVOL),	T_CMD_SETVOL}
+};
+
+#endif /* FSM_TABLE_H_ */
@@ -95,7 +95,9 @@ Date        Description
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include <util/atomic.h>
+#include <string.h>
 #include "uart.h"
+#include "../probe.h"
 
 /*
  *  constants and macros
@@ -115,6 +117,15 @@ Date        Description
 	#error TX0 buffer size is not a power of 2
 #endif
 
+#define UART_TXD0_QUEUE_MASK (UART_TXD0_QUEUE_SIZE - 1)
+
+#if (UART_TXD0_QUEUE_SIZE & UART_TXD0_QUEUE_MASK)
+	#error TXD0 queue size is not a power of 2
+#endif
+#if (UART_TXD0_QUEUE_SIZE > 256)
+	#error TXD0 queue too large, 8 bit indexes are used
+#endif
+
 #if (UART_RX1_BUFFER_SIZE & UART_RX1_BUFFER_MASK)
 	#error RX1 buffer size is not a power of 2
 #endif
@@ -161,6 +172,23 @@ Date        Description
 		static volatile uint8_t UART_RxTail;
 		static volatile uint8_t UART_LastRxError;
 	#endif
+	static uint16_t UART_TxDropped;
+
+	/*
+	 * Transmit descriptor queue. Each descriptor either points to a string
+	 * in program memory, which is read by the UDRE interrupt directly, or
+	 * covers a run of bytes in the RAM transmit ringbuffer. Flash strings
+	 * therefore take no space in the ringbuffer.
+	 */
+	typedef struct {
+		const char *addr;        /* flash address, unused for RAM runs */
+		uint16_t len;            /* remaining bytes of this descriptor */
+		uint8_t flash;           /* 1: flash string, 0: RAM ringbuffer run */
+	} uart_txd;
+
+	static volatile uart_txd UART_TxdQueue[UART_TXD0_QUEUE_SIZE];
+	static volatile uint8_t UART_TxdHead;
+	static volatile uint8_t UART_TxdTail;
 #endif
 
 #if defined(USART1_ENABLED)
@@ -180,6 +208,7 @@ Date        Description
 		static volatile uint8_t UART1_RxTail;
 		static volatile uint8_t UART1_LastRxError;
 	#endif		
+	static uint16_t UART1_TxDropped;
 #endif
 
 #if defined(USART0_ENABLED)
@@ -194,6 +223,7 @@ Purpose:  called when the UART has received a character
     uint8_t data;
     uint8_t usr;
     uint8_t lastRxError;
+    PROBE_ON(PRB_UART);
  
     /* read UART status register and UART data register */ 
     usr  = UART0_STATUS;
@@ -215,6 +245,7 @@ Purpose:  called when the UART has received a character
         UART_RxBuf[tmphead] = data;
     }
     UART_LastRxError = lastRxError;   
+    PROBE_OFF(PRB_UART);
 }
 
 
@@ -225,20 +256,77 @@ Purpose:  called when the UART is ready to transmit the next byte
 **************************************************************************/
 {
     uint16_t tmptail;
-
-    if (UART_TxHead != UART_TxTail) {
-        /* calculate and store new buffer index */
-        tmptail = (UART_TxTail + 1) & UART_TX0_BUFFER_MASK;
-        UART_TxTail = tmptail;
-        /* get one byte from buffer and write it to UART */
-        UART0_DATA = UART_TxBuf[tmptail];  /* start transmission */
+    uint8_t txdtail;
+    volatile uart_txd *txd;
+    PROBE_ON(PRB_UART);
+
+    if (UART_TxdHead != UART_TxdTail) {
+        txdtail = (UART_TxdTail + 1) & UART_TXD0_QUEUE_MASK;
+        txd = &UART_TxdQueue[txdtail];
+
+        if (txd->flash) {
+            /* read next byte of the string directly from flash */
+            UART0_DATA = pgm_read_byte(txd->addr);
+            txd->addr++;
+        } else {
+            /* calculate and store new buffer index */
+            tmptail = (UART_TxTail + 1) & UART_TX0_BUFFER_MASK;
+            UART_TxTail = tmptail;
+            /* get one byte from buffer and write it to UART */
+            UART0_DATA = UART_TxBuf[tmptail];  /* start transmission */
+        }
+
+        /* descriptor done, release it */
+        if (--txd->len == 0) {
+            UART_TxdTail = txdtail;
+        }
     } else {
-        /* tx buffer empty, disable UDRE interrupt */
+        /* tx queue empty, disable UDRE interrupt */
         UART0_CONTROL &= ~_BV(UART0_UDRIE);
     }
+    PROBE_OFF(PRB_UART);
 }
 
 
+/*************************************************************************
+Function: uart0_txd_ram_append()
+Purpose:  account n bytes stored at the ringbuffer head to the transmit
+          descriptor queue. Extends the last descriptor if it is a RAM run,
+          otherwise a new RAM descriptor is queued
+          This is the interrupt-disabled section of every RAM write, it is
+          entered once per run (uart0_puts) and not once per byte: about
+          30 cycles (4 us at 8 MHz), measure with "probe atomic"
+Input:    n - number of bytes
+Returns:  UART_TX_OK or UART_TX_WOULDBLOCK if the descriptor queue is full
+**************************************************************************/
+static uint8_t uart0_txd_ram_append(uint8_t n)
+{
+	uint8_t txdhead;
+	uint8_t ret = UART_TX_WOULDBLOCK;
+
+	ATOMIC_BLOCK(ATOMIC_FORCEON) {
+		PROBE_ON(PRB_ATOMIC);
+		if (UART_TxdHead != UART_TxdTail && !UART_TxdQueue[UART_TxdHead].flash
+			&& UART_TxdQueue[UART_TxdHead].len <= UINT16_MAX - n) {
+			/* the ISR may be sending this run right now, so stay atomic */
+			UART_TxdQueue[UART_TxdHead].len += n;
+			ret = UART_TX_OK;
+		} else {
+			txdhead = (UART_TxdHead + 1) & UART_TXD0_QUEUE_MASK;
+			if (txdhead != UART_TxdTail) {
+				UART_TxdQueue[txdhead].flash = 0;
+				UART_TxdQueue[txdhead].len = n;
+				UART_TxdHead = txdhead;
+				ret = UART_TX_OK;
+			}
+		}
+		PROBE_OFF(PRB_ATOMIC);
+	}
+	return ret;
+
+} /* uart0_txd_ram_append */
+
+
 /*************************************************************************
 Function: uart0_init()
 Purpose:  initialize UART and set baudrate
@@ -252,12 +340,16 @@ void uart0_init(uint16_t baudrate)
 		UART_TxTail = 0;
 		UART_RxHead = 0;
 		UART_RxTail = 0;
+		UART_TxdHead = 0;
+		UART_TxdTail = 0;
 	}
 	
 	/* Set baud rate */
 	if (baudrate & 0x8000) {
 		UART0_STATUS = (1<<U2X0);  //Enable 2x speed
 		baudrate &= ~0x8000;
+	} else {
+		UART0_STATUS = 0;          //Disable 2x speed, it may be set from a previous init
 	}
 	UBRR0H = (uint8_t)(baudrate>>8);
 	UBRR0L = (uint8_t) baudrate;
@@ -286,11 +378,18 @@ uint16_t uart0_getc(void)
 	uint16_t tmptail;
 	uint8_t data;
 
+#ifdef USART0_LARGE_BUFFER
 	ATOMIC_BLOCK(ATOMIC_FORCEON) {
 		if (UART_RxHead == UART_RxTail) {
 			return UART_NO_DATA;   /* no data available */
 		}
 	}
+#else
+	/* 8 bit indexes are read atomically, interrupts stay enabled */
+	if (UART_RxHead == UART_RxTail) {
+		return UART_NO_DATA;   /* no data available */
+	}
+#endif
 	
 	/* calculate / store buffer index */
 	tmptail = (UART_RxTail + 1) & UART_RX0_BUFFER_MASK;
@@ -318,11 +417,18 @@ uint16_t uart0_peek(void)
 	uint16_t tmptail;
 	uint8_t data;
 
+#ifdef USART0_LARGE_BUFFER
 	ATOMIC_BLOCK(ATOMIC_FORCEON) {
 		if (UART_RxHead == UART_RxTail) {
 			return UART_NO_DATA;   /* no data available */
 		}
 	}
+#else
+	/* 8 bit indexes are read atomically, interrupts stay enabled */
+	if (UART_RxHead == UART_RxTail) {
+		return UART_NO_DATA;   /* no data available */
+	}
+#endif
 	
 	tmptail = (UART_RxTail + 1) & UART_RX0_BUFFER_MASK;
 
@@ -364,6 +470,9 @@ void uart0_putc(uint8_t data)
 	UART_TxBuf[tmphead] = data;
 	UART_TxHead = tmphead;
 
+	/* hand the byte over to the ISR, wait for a free descriptor */
+	while (uart0_txd_ram_append(1) != UART_TX_OK);
+
 	/* enable UDRE interrupt */
 	UART0_CONTROL |= _BV(UART0_UDRIE);
 
@@ -378,8 +487,36 @@ Returns:  none
 **************************************************************************/
 void uart0_puts(const char *s)
 {
+	uint16_t tmphead;
+	uint16_t txtail_tmp;
+	uint8_t n;
+
 	while (*s) {
-		uart0_putc(*s++);
+#ifdef USART0_LARGE_BUFFER
+		ATOMIC_BLOCK(ATOMIC_FORCEON) {
+			txtail_tmp = UART_TxTail;
+		}
+#else
+		txtail_tmp = UART_TxTail;
+#endif
+		/* copy as much as fits, the ISR only frees more space (tail snapshot) */
+		tmphead = UART_TxHead;
+		n = 0;
+		while (*s && ((tmphead + 1) & UART_TX0_BUFFER_MASK) != txtail_tmp) {
+			tmphead = (tmphead + 1) & UART_TX0_BUFFER_MASK;
+			UART_TxBuf[tmphead] = *s++;
+			n++;
+		}
+		if (n == 0) {
+			continue; /* wait for free space in buffer */
+		}
+		UART_TxHead = tmphead;
+
+		/* hand the run over to the ISR, wait for a free descriptor */
+		while (uart0_txd_ram_append(n) != UART_TX_OK);
+
+		/* enable UDRE interrupt */
+		UART0_CONTROL |= _BV(UART0_UDRIE);
 	}
 
 } /* uart0_puts */
@@ -393,16 +530,136 @@ Returns:  none
 **************************************************************************/
 void uart0_puts_p(const char *progmem_s)
 {
-	register char c;
+	uint8_t txdhead;
+	uint16_t len;
 
-	while ((c = pgm_read_byte(progmem_s++))) {
-		uart0_putc(c);
+	len = strlen_P(progmem_s);
+	if (len == 0) {
+		return;
 	}
 
+	/* queue a flash descriptor, the string is not copied to RAM */
+	txdhead = (UART_TxdHead + 1) & UART_TXD0_QUEUE_MASK;
+
+	while (txdhead == UART_TxdTail); /* wait for free descriptor */
+
+	UART_TxdQueue[txdhead].addr = progmem_s;
+	UART_TxdQueue[txdhead].len = len;
+	UART_TxdQueue[txdhead].flash = 1;
+	UART_TxdHead = txdhead;
+
+	/* enable UDRE interrupt */
+	UART0_CONTROL |= _BV(UART0_UDRIE);
+
 } /* uart0_puts_p */
 
 
 
+/*************************************************************************
+Function: uart0_try_putc()
+Purpose:  write byte to ringbuffer for transmitting via UART, never blocks
+Input:    byte to be transmitted
+Returns:  UART_TX_OK or UART_TX_WOULDBLOCK if the ringbuffer is full
+**************************************************************************/
+uint8_t uart0_try_putc(uint8_t data)
+{
+	if (uart0_tx_free() == 0) {
+		return UART_TX_WOULDBLOCK;
+	}
+	uart0_putc(data);
+	return UART_TX_OK;
+
+} /* uart0_try_putc */
+
+
+/*************************************************************************
+Function: uart0_putc_lp()
+Purpose:  write low priority byte to ringbuffer, the byte is dropped and
+          counted if the ringbuffer is full
+Input:    byte to be transmitted
+Returns:  none
+**************************************************************************/
+void uart0_putc_lp(uint8_t data)
+{
+	if (uart0_try_putc(data) != UART_TX_OK) {
+		UART_TxDropped++;
+	}
+
+} /* uart0_putc_lp */
+
+
+/*************************************************************************
+Function: uart0_puts_lp()
+Purpose:  transmit low priority string to UART, the string is dropped and
+          counted if it does not fit completely into the ringbuffer
+Input:    string to be transmitted
+Returns:  UART_TX_OK or UART_TX_WOULDBLOCK if the string was dropped
+**************************************************************************/
+uint8_t uart0_puts_lp(const char *s)
+{
+	uint16_t len = strlen(s);
+
+	if (len > uart0_tx_free()) {
+		UART_TxDropped += len;
+		return UART_TX_WOULDBLOCK;
+	}
+	uart0_puts(s);
+	return UART_TX_OK;
+
+} /* uart0_puts_lp */
+
+
+/*************************************************************************
+Function: uart0_tx_free()
+Purpose:  Determine the number of free bytes in the transmit buffer
+Input:    None
+Returns:  Integer number of free bytes in the transmit buffer
+**************************************************************************/
+uint16_t uart0_tx_free(void)
+{
+	uint16_t ret;
+
+#ifdef USART0_LARGE_BUFFER
+	ATOMIC_BLOCK(ATOMIC_FORCEON) {
+		ret = (UART_TxTail - UART_TxHead - 1) & UART_TX0_BUFFER_MASK;
+	}
+#else
+	/* 8 bit indexes are read atomically, interrupts stay enabled */
+	ret = (UART_TxTail - UART_TxHead - 1) & UART_TX0_BUFFER_MASK;
+#endif
+
+	/* no free descriptor for a new RAM run: treat as full */
+	if (((UART_TxdHead + 1) & UART_TXD0_QUEUE_MASK) == UART_TxdTail) {
+		ret = 0;
+	}
+	return ret;
+} /* uart0_tx_free */
+
+
+/*************************************************************************
+Function: uart0_tx_busy()
+Purpose:  Check if transmit data is still queued
+Input:    None
+Returns:  1 if data is queued, 0 if the transmit queue is empty
+**************************************************************************/
+uint8_t uart0_tx_busy(void)
+{
+	return UART_TxdHead != UART_TxdTail;
+} /* uart0_tx_busy */
+
+
+/*************************************************************************
+Function: uart0_tx_dropped()
+Purpose:  Number of low priority bytes which were dropped
+Input:    None
+Returns:  Integer number of dropped bytes
+**************************************************************************/
+uint16_t uart0_tx_dropped(void)
+{
+	return UART_TxDropped;
+} /* uart0_tx_dropped */
+
+
 /*************************************************************************
 Function: uart0_available()
 Purpose:  Determine the number of bytes waiting in the receive buffer
@@ -413,9 +670,14 @@ uint16_t uart0_available(void)
 {
 	uint16_t ret;
 	
+#ifdef USART0_LARGE_BUFFER
 	ATOMIC_BLOCK(ATOMIC_FORCEON) {
 		ret = (UART_RX0_BUFFER_SIZE + UART_RxHead - UART_RxTail) & UART_RX0_BUFFER_MASK;
 	}
+#else
+	/* 8 bit indexes are read atomically, interrupts stay enabled */
+	ret = (UART_RX0_BUFFER_SIZE + UART_RxHead - UART_RxTail) & UART_RX0_BUFFER_MASK;
+#endif
 	return ret;
 } /* uart0_available */
 
@@ -460,6 +722,7 @@ Purpose:  called when the UART1 has received a character
 	uint8_t data;
 	uint8_t usr;
 	uint8_t lastRxError;
+	PROBE_ON(PRB_UART);
 
 	/* read UART status register and UART data register */
 	usr  = UART1_STATUS;
@@ -481,6 +744,7 @@ Purpose:  called when the UART1 has received a character
 		UART1_RxBuf[tmphead] = data;
 	}
 	UART1_LastRxError = lastRxError;
+	PROBE_OFF(PRB_UART);
 }
 
 
@@ -491,6 +755,7 @@ Purpose:  called when the UART1 is ready to transmit the next byte
 **************************************************************************/
 {
 	uint16_t tmptail;
+	PROBE_ON(PRB_UART);
 
 	if (UART1_TxHead != UART1_TxTail) {
 		/* calculate and store new buffer index */
@@ -502,6 +767,7 @@ Purpose:  called when the UART1 is ready to transmit the next byte
 		/* tx buffer empty, disable UDRE interrupt */
 		UART1_CONTROL &= ~_BV(UART1_UDRIE);
 	}
+	PROBE_OFF(PRB_UART);
 }
 
 
@@ -524,6 +790,8 @@ void uart1_init(uint16_t baudrate)
 	if (baudrate & 0x8000) {
 		UART1_STATUS = (1<<U2X1);  //Enable 2x speed
 		baudrate &= ~0x8000;
+	} else {
+		UART1_STATUS = 0;          //Disable 2x speed, it may be set from a previous init
 	}
 	UBRR1H = (uint8_t) (baudrate>>8);
 	UBRR1L = (uint8_t) baudrate;
@@ -698,6 +966,101 @@ void uart1_flush(void)
 	}
 } /* uart1_flush */
 
+
+/*************************************************************************
+Function: uart1_tx_free()
+Purpose:  Determine the number of free bytes in the transmit buffer
+Input:    None
+Returns:  Integer number of free bytes in the transmit buffer
+**************************************************************************/
+uint16_t uart1_tx_free(void)
+{
+	uint16_t ret;
+
+#ifdef USART1_LARGE_BUFFER
+	ATOMIC_BLOCK(ATOMIC_FORCEON) {
+		ret = (UART1_TxTail - UART1_TxHead - 1) & UART_TX1_BUFFER_MASK;
+	}
+#else
+	/* 8 bit indexes are read atomically, interrupts stay enabled */
+	ret = (UART1_TxTail - UART1_TxHead - 1) & UART_TX1_BUFFER_MASK;
+#endif
+	return ret;
+} /* uart1_tx_free */
+
+
+/*************************************************************************
+Function: uart1_tx_busy()
+Purpose:  Check if transmit data of USART1 is still queued
+Input:    None
+Returns:  1 if data is queued, 0 if the transmit buffer is empty
+**************************************************************************/
+uint8_t uart1_tx_busy(void)
+{
+	uint8_t ret;
+
+#ifdef USART1_LARGE_BUFFER
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		ret = UART1_TxHead != UART1_TxTail;
+	}
+#else
+	/* 8 bit indexes are read atomically, interrupts stay enabled */
+	ret = UART1_TxHead != UART1_TxTail;
+#endif
+	return ret;
+} /* uart1_tx_busy */
+
+
+/*************************************************************************
+Function: uart1_putc_lp()
+Purpose:  write low priority byte to ringbuffer, the byte is dropped and
+          counted if the ringbuffer is full
+Input:    byte to be transmitted
+Returns:  none
+**************************************************************************/
+void uart1_putc_lp(uint8_t data)
+{
+	if (uart1_tx_free() == 0) {
+		UART1_TxDropped++;
+		return;
+	}
+	uart1_putc(data);
+
+} /* uart1_putc_lp */
+
+
+/*************************************************************************
+Function: uart1_puts_lp()
+Purpose:  transmit low priority string to UART1, the string is dropped and
+          counted if it does not fit completely into the ringbuffer
+Input:    string to be transmitted
+Returns:  UART_TX_OK or UART_TX_WOULDBLOCK if the string was dropped
+**************************************************************************/
+uint8_t uart1_puts_lp(const char *s)
+{
+	uint16_t len = strlen(s);
+
+	if (len > uart1_tx_free()) {
+		UART1_TxDropped += len;
+		return UART_TX_WOULDBLOCK;
+	}
+	uart1_puts(s);
+	return UART_TX_OK;
+
+} /* uart1_puts_lp */
+
+
+/*************************************************************************
+Function: uart1_tx_dropped()
+Purpose:  Number of low priority bytes which were dropped
+Input:    None
+Returns:  Integer number of dropped bytes
+**************************************************************************/
+uint16_t uart1_tx_dropped(void)
+{
+	return UART1_TxDropped;
+} /* uart1_tx_dropped */
+
 #endif
 
 #endif /* defined(USART1_ENABLED) */
\ No newline at end of file
@@ -95,7 +95,9 @@ were adapted from the Arduino HardwareSerial.h library by Tim Sharpe on
 	#define USART0_ENABLED /**< Enable USART0 */
 #endif
 
-//#define USART1_ENABLED
+#ifndef USART1_ENABLED
+	#define USART1_ENABLED /**< Enable USART1 (second command channel at the external connector) */
+#endif
 
 
 /* Set size of receive and transmit buffers */
@@ -103,14 +105,17 @@ were adapted from the Arduino HardwareSerial.h library by Tim Sharpe on
 	#define UART_RX0_BUFFER_SIZE 128 /**< Size of the circular receive buffer, must be power of 2 */
 #endif
 #ifndef UART_RX1_BUFFER_SIZE
-	#define UART_RX1_BUFFER_SIZE 128 /**< Size of the circular receive buffer, must be power of 2 */
+	#define UART_RX1_BUFFER_SIZE 32 /**< Size of the circular receive buffer, must be power of 2 */
 #endif
 
 #ifndef UART_TX0_BUFFER_SIZE
-	#define UART_TX0_BUFFER_SIZE 128 /**< Size of the circular transmit buffer, must be power of 2 */
+	#define UART_TX0_BUFFER_SIZE 64 /**< Size of the circular transmit buffer, must be power of 2 */
+#endif
+#ifndef UART_TXD0_QUEUE_SIZE
+	#define UART_TXD0_QUEUE_SIZE 8 /**< Number of transmit descriptors (flash strings / RAM byte runs), must be power of 2 */
 #endif
 #ifndef UART_TX1_BUFFER_SIZE
-	#define UART_TX1_BUFFER_SIZE 128 /**< Size of the circular transmit buffer, must be power of 2 */
+	#define UART_TX1_BUFFER_SIZE 64 /**< Size of the circular transmit buffer, must be power of 2 */
 #endif
 
 /* Check buffer sizes are not too large for 8-bit positioning */
@@ -145,6 +150,19 @@ were adapted from the Arduino HardwareSerial.h library by Tim Sharpe on
  */
 #define UART_BAUD_SELECT_DOUBLE_SPEED(baudRate,xtalCpu) ((((xtalCpu)+4UL*(baudRate))/(8UL*(baudRate))-1)|0x8000)
 
+/** @brief  Real baudrate of a UART_BAUD_SELECT_DOUBLE_SPEED() value
+ *  @param  baudSel  value returned by UART_BAUD_SELECT_DOUBLE_SPEED()
+ *  @param  xtalCpu  system clock in Mhz, e.g. 4000000L for 4Mhz
+ */
+#define UART_BAUD_REAL_DOUBLE_SPEED(baudSel,xtalCpu) ((xtalCpu)/(8UL*(((baudSel) & 0x7FFF)+1UL)))
+
+/** @brief  Deviation of the real from the requested baudrate in per mille
+ *  @param  baudReal real baudrate e.g. from UART_BAUD_REAL_DOUBLE_SPEED()
+ *  @param  baudRate requested baudrate in bps
+ */
+#define UART_BAUD_ERROR_PERMILLE(baudReal,baudRate) \
+	(((baudReal) > (baudRate)) ? (((baudReal)-(baudRate))*1000UL/(baudRate)) : (((baudRate)-(baudReal))*1000UL/(baudRate)))
+
 /* test if the size of the circular buffers fits into SRAM */
 
 #if defined(USART0_ENABLED) && ( (UART_RX0_BUFFER_SIZE+UART_TX0_BUFFER_SIZE) >= (RAMEND-0x60))
@@ -163,6 +181,12 @@ were adapted from the Arduino HardwareSerial.h library by Tim Sharpe on
 #define UART_BUFFER_OVERFLOW  0x0200              /**< receive ringbuffer overflow */
 #define UART_NO_DATA          0x0100              /**< no receive data available   */
 
+/*
+** return codes of the non blocking transmit functions
+*/
+#define UART_TX_OK            0                   /**< data was put to the transmit ringbuffer       */
+#define UART_TX_WOULDBLOCK    1                   /**< not enough space in the transmit ringbuffer   */
+
 /* Macros, to allow use of legacy names */
 
 /** @brief Macro to initialize USART0 (only available on selected ATmegas) @see uart0_init */
@@ -298,6 +322,52 @@ extern void uart0_puts_p(const char *s);
 /** @brief  Macro to automatically put a string constant into program memory */
 #define uart0_puts_P(__s)      uart0_puts_p(PSTR(__s))
 
+/**
+ *  @brief   Put byte to ringbuffer for transmitting via UART, never blocks
+ *  @param   data byte to be transmitted
+ *  @return  UART_TX_OK or UART_TX_WOULDBLOCK if the ringbuffer is full
+ */
+extern uint8_t uart0_try_putc(uint8_t data);
+
+/**
+ *  @brief   Put a low priority byte to ringbuffer for transmitting via UART
+ *
+ *  The byte is dropped and counted if the ringbuffer is full (e.g. wait animations).
+ *
+ *  @param   data byte to be transmitted
+ *  @return  none
+ */
+extern void uart0_putc_lp(uint8_t data);
+
+/**
+ *  @brief   Put a low priority string to ringbuffer for transmitting via UART
+ *
+ *  The string is only transmitted if it fits completely into the ringbuffer,
+ *  otherwise it is dropped and its bytes are counted. Never blocks.
+ *
+ *  @param   s string to be transmitted
+ *  @return  UART_TX_OK or UART_TX_WOULDBLOCK if the string was dropped
+ */
+extern uint8_t uart0_puts_lp(const char *s);
+
+/**
+ *  @brief   Check if transmit data is still queued
+ *  @return  1 if data is queued, 0 if the transmit queue is empty
+ */
+extern uint8_t uart0_tx_busy(void);
+
+/**
+ *  @brief   Return number of free bytes in the transmit buffer
+ *  @return  free bytes in the transmit buffer
+ */
+extern uint16_t uart0_tx_free(void);
+
+/**
+ *  @brief   Return number of low priority bytes which were dropped
+ *  @return  number of dropped bytes
+ */
+extern uint16_t uart0_tx_dropped(void);
+
 /**
  *  @brief   Return number of bytes waiting in the receive buffer
  *  @return  bytes waiting in the receive buffer
@@ -338,5 +408,20 @@ extern uint16_t uart1_available(void);
 /** @brief  Flush bytes waiting in receive buffer of USART1 */
 extern void uart1_flush(void);
 
+/** @brief  Put a low priority byte to ringbuffer of USART1, dropped and counted if full @see uart0_putc_lp */
+extern void uart1_putc_lp(uint8_t data);
+
+/** @brief  Put a low priority string to ringbuffer of USART1, dropped and counted if it does not fit @see uart0_puts_lp */
+extern uint8_t uart1_puts_lp(const char *s);
+
+/** @brief  Return number of free bytes in the transmit buffer of USART1 */
+extern uint16_t uart1_tx_free(void);
+
+/** @brief  Check if transmit data of USART1 is still queued @see uart0_tx_busy */
+extern uint8_t uart1_tx_busy(void);
+
+/** @brief  Return number of low priority bytes of USART1 which were dropped */
+extern uint16_t uart1_tx_dropped(void);
+
 #endif // UART_H 
 
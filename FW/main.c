@@ -34,21 +34,64 @@
 #include "./UART/uart.h"
 #include "./IMRP/irmp.h"
 #include "./CMD/cmd.h"
+#include "./CMD/cmdparser.h"
 #include "avr/eeprom.h"
+#include <avr/sleep.h>
 
 //GLOBAL VARIABLES (INTERRUPT)
-volatile uint8_t inc_timer_stat = 0;
+//8 bit variables are read atomically. Multi byte variables are read by the
+//main loop with a retry loop (sys_ms_get, adc_val_get) instead of disabling interrupts
 volatile uint8_t FSM_STATE = 0;
 volatile uint16_t adc_val = 0;
+volatile uint8_t adc_seq = 0;		//Incremented after every update of adc_val
+volatile uint16_t sys_ms = 0;		//System millisecond tick (timer 3)
+volatile sw_timer tmr[NUM_TMRS];	//Software timers, ticked by timer 3 (written with interrupts disabled)
+volatile uint32_t adc_isr_cnt = 0;	//Number of ADC interrupts (profiling)
+volatile uint16_t stream_period_ms = 0;	//Telemetry sample period, 0: off (written with interrupts disabled)
+volatile uint8_t stream_due = FALSE;	//Set by the tick when a telemetry sample is due
+volatile uint8_t sys_evt = 0;		//Pending interrupt events (EVT_*), cleared before fsm() runs
+volatile uint8_t probe_sel = PRB_NONE;	//Section which drives the scope probe pin
+#if STATS_ENABLED
+	volatile uint8_t cpu_idle = FALSE;	//CPU sleeps, sampled by the tick for the duty cycle
+	volatile uint16_t idle_smp_cnt = 0;	//Ticks which interrupted the sleeping CPU
+#endif
 
 //Global IRMP DATA STRUCT
 IRMP_DATA irmp_data;
 
 //MISC GLOBAL VARIABLES
 uint16_t setvol_targ = 0;
+uint8_t  setvol_ramp_pct = 0;		//Target of a setvol ramp in percent
+uint16_t setvol_ramp_dur = 0;		//Duration of a setvol ramp in ms
 uint8_t ir_keyset_len = 0;
 ir_key ir_keyset[IR_KEY_MAX_NUM];
+char ir_key_desc[IR_KEY_MAX_NUM][MAX_ARG_LEN];
+uint8_t ir_key_slot[IR_KEY_MAX_NUM];	//EEPROM journal record id of the key (ascending)
 uint16_t inc_dur;
+uint8_t baud_idx = BAUD_IDX_DEFAULT;	//Active entry of the baudrate table
+uint8_t baud_idx_saved;					//Confirmed entry of the baudrate table (EEPROM copy)
+uint8_t pwr_5v_led;
+uint8_t pwr_3v3_led;
+
+//EEPROM JOURNAL WRITER
+uint8_t ee_buf[EE_REC_MAX + 1];		//Record (or segment header) and end mark, written by the EE_READY ISR
+uint16_t ee_buf_addr;
+uint8_t ee_buf_inval;				//Invalid value of the commit byte ee_buf[0]
+volatile uint8_t ee_buf_len = 0;	//0: writer idle
+volatile uint8_t ee_buf_pos = 0;
+
+//SETVOL STATISTICS
+uint16_t setvol_coal_cnt = 0;	//setvol commands which replaced the target of a running search
+uint16_t setvol_rev_cnt = 0;	//coalesced setvol commands which required a direction reversal
+
+//RUNTIME STATISTICS (stats command)
+#if STATS_ENABLED
+	stats_data st;
+#endif
+
+//MOTOR FAULT LOG
+uint8_t  motor_fault_last = MOTOR_FAULT_NONE;
+uint16_t motor_fault_cnt = 0;
 
 
 //COMMAND SET: (ALL SUPPORTED COMMANDS)
@@ -63,45 +106,121 @@ command cmd_set[NUM_CMDS] = {{0, &volup,	 "volup"},
 							 {1, &set5vled,  "set5vled"},
 							 {1, &set3v3led, "set3v3led"}, 
 							 {1, &setincdur, "setincdur"},
-							 {0, &getincdur, "getincdur"}};
+							 {0, &getincdur, "getincdur"},
+							 {0, &stats,	 "stats"},
+							 {1, &setbaud,	 "setbaud"},
+							 {1, &stream,	 "stream"},
+							 {0, &trace,	 "trace"},
+							 {0, &probe,	 "probe"},
+							 {0, &mem,		 "mem"}};
 								 
-//EEEPROM DEFLAUT VALUES
+//FIXED EEPROM LAYOUT OF OLDER FIRMWARE (imported once by ee_init, then overwritten by the journal)
+//Declaration order and types must not change, they define the addresses of the old values
 uint8_t  EEMEM eeprom_ir_keyset_len = 0;
 uint8_t  EEMEM eeprom_pwr_5v_led = 1;
 uint8_t  EEMEM eeprom_pwr_3v3_led = 1;
-ir_key   EEMEM eeprom_ir_keyset[IR_KEY_MAX_NUM];
-char     EEMEM eeprom_ir_key_desc[IR_KEY_MAX_NUM][MAX_ARG_LEN];
+ir_key   EEMEM eeprom_ir_keyset[EE_OLD_KEY_NUM];
+char     EEMEM eeprom_ir_key_desc[EE_OLD_KEY_NUM][MAX_ARG_LEN];
 uint16_t EEMEM eeprom_inc_dur = EEPROM_INC_DURATION;
+uint8_t  EEMEM eeprom_baud_idx = BAUD_IDX_DEFAULT;
+
+/*------------------------------------------------------------------------------------------------------
+ * STACK PAINTING
+ *------------------------------------------------------------------------------------------------------*/
+
+#define STACK_PAINT_STR(x)	STACK_PAINT_STR_(x)
+#define STACK_PAINT_STR_(x)	#x
+
+// Fills the RAM between the end of .bss and RAMEND with STACK_PAINT (mem command)
+// Runs in .init1 before the stack pointer is set up: naked, no calls, no stack usage
+// Only basic asm is safe in a naked function, the loop uses Z and no C variables
+void stack_paint (void) __attribute__ ((naked, used, section (".init1")));
+void stack_paint (void){
+	__asm__ volatile (
+		"ldi r30, lo8(_end)\n\t"
+		"ldi r31, hi8(_end)\n\t"
+		"ldi r24, " STACK_PAINT_STR(STACK_PAINT) "\n\t"
+		"ldi r25, hi8(" STACK_PAINT_STR(RAMEND) " + 1)\n"
+		"1:\n\t"
+		"st Z+, r24\n\t"
+		"cpi r30, lo8(" STACK_PAINT_STR(RAMEND) " + 1)\n\t"
+		"cpc r31, r25\n\t"
+		"brne 1b\n\t"
+	);
+}
 
 
 /*------------------------------------------------------------------------------------------------------
  * TIMER INITIALIZATION
  *------------------------------------------------------------------------------------------------------*/
 
-// TIMER 3: Volume increment counter
+// TIMER 3: 1 ms system tick
 static void timer3_init (void){
-	//16Bit Timer
-	//TC1 Control Register B
-	//Mode 4 - CTC (clear timer on compare)
-	TCCR3B =  (1 << WGM32);
-	
-	//Do not set the prescaler -> timer is not started!
-
 	//Output Compare Register 3 A Low and High byte 
-	//Sets the counter value at which the interrupt gets executed
-	OCR3A = (uint16_t) TIMER_COMP_VAL(TIMER3_PRESCALER, inc_dur); //16Bit value is correct addressed automatically
+	//Sets the counter value at which the interrupt gets executed (CTC: compare value + 1 counts)
+	OCR3A = (uint16_t) TIMER_COMP_VAL(TIMER3_PRESCALER, 1) - 1; //16Bit value is correct addressed automatically
+
+	//16Bit Timer
+	//TC3 Control Register B
+	//Mode 4 - CTC (clear timer on compare), start with the prescaler
+	TCCR3B =  (1 << WGM32) | TIMER3_PRESCALER_VAL;
 	
 	//Counter 3 Interrupt Mask Register
 	//Set OCIE3A Flag: Timer/Counter 3, Output Compare A Match Interrupt Enable
  	TIMSK3 = (1 << OCIE3A);
 }
 
-// TIMER 3 Volume increment interrupt service routine, called every inc_duration
+// TIMER 3 system tick interrupt service routine, called every ms
+// Increments sys_ms and ticks the software timers
 ISR(TIMER3_COMPA_vect)
 {
-	//every INC_DURATION ms
-	//clear the prescaler value to stop the counter
-	inc_timer_stop();
+	static uint16_t stream_cnt = 0;
+
+	PROBE_ON(PRB_TICK);
+	sys_ms++;
+
+	#if STATS_ENABLED
+		//Duty cycle: sample the sleep state of the main loop
+		if (cpu_idle){
+			idle_smp_cnt++;
+		}
+	#endif
+
+	//Telemetry sample tick
+	if (stream_period_ms && (++stream_cnt >= stream_period_ms)){
+		stream_cnt = 0;
+		stream_due = TRUE;
+		sys_evt |= EVT_TMR;
+	}
+
+	//Software timers: set the expiry event, reload periodic timers
+	for (uint8_t i = 0; i < NUM_TMRS; i++){
+		if (tmr[i].run && (--tmr[i].cnt == 0)){
+			tmr[i].evt = TRUE;
+			sys_evt |= EVT_TMR;
+			if (tmr[i].period){
+				tmr[i].cnt = tmr[i].period;
+			}
+			else {
+				tmr[i].run = FALSE;
+			}
+		}
+	}
+	PROBE_OFF(PRB_TICK);
+}
+
+// TIMER 0: ADC trigger
+static void timer0_init (void){
+	//8Bit Timer
+	//Mode 2 - CTC (clear timer on compare)
+	TCCR0A = (1 << WGM01);
+
+	//Start with the idle sample rate
+	OCR0A = TIMER0_OCR_LO;
+	TCCR0B = TIMER0_PRESCALER_VAL_LO;
+
+	//No interrupt: the compare match triggers the ADC conversion,
+	//the ADC ISR clears the compare flag
 }
 
 // TIMER 1: IRMP Timer		
@@ -116,9 +235,51 @@ static void timer1_init (void)
 // TIMER :1 IRMP Interrupt service routine, called every 1/15000 sec
 ISR(TIMER1_COMPA_vect)
 {
-	(void) irmp_ISR();	//Call IRMP ISR
+	PROBE_ON(PRB_IRMP);
+
+	//Call IRMP ISR, returns TRUE if a decoded frame is waiting
+	if (irmp_ISR()){
+		sys_evt |= EVT_IR;
+	}
+
+	PROBE_OFF(PRB_IRMP);
 }
 
+/*------------------------------------------------------------------------------------------------------
+ * EEPROM JOURNAL WRITER
+ *------------------------------------------------------------------------------------------------------*/
+
+// EEPROM ready: writes the next byte of the journal record in ee_buf, unchanged bytes are skipped
+// Order: ee_buf_inval to ee_buf[0], ee_buf[1 ... len-1], ee_buf[0] (commit)
+// The interrupt is disabled when the record is written, ee_task() starts the next one
+// At most EE_SCAN_MAX bytes are compared per interrupt, it fires again right after the return
+ISR(EE_READY_vect){
+	uint8_t idx;
+	uint8_t data;
+
+	for (uint8_t i = 0; i < EE_SCAN_MAX; i++){
+		if (ee_buf_pos > ee_buf_len){
+			EECR &= ~(1 << EERIE);
+			ee_buf_len = 0;
+			return;
+		}
+		idx = (ee_buf_pos == ee_buf_len) ? 0 : ee_buf_pos;
+		data = ee_buf_pos ? ee_buf[idx] : ee_buf_inval;
+		ee_buf_pos++;
+
+		EEAR = ee_buf_addr + idx;
+		EECR |= (1 << EERE);
+		if (EEDR != data){
+			//Erase and write, EEPE has to follow EEMPE within 4 cycles
+			EEDR = data;
+			EECR |= (1 << EEMPE);
+			EECR |= (1 << EEPE);
+			return;
+		}
+	}
+}
+
+
 /*------------------------------------------------------------------------------------------------------
  * ADC INITIALIZATION
  *------------------------------------------------------------------------------------------------------*/
@@ -135,19 +296,55 @@ void adc0_init(){
 	ADCSRA = ( 1 << ADEN) | (1 << ADIE) |
 	( 1 << ADPS0) | (1 << ADPS1) | (1 << ADPS2) |
 	( 1 << ADATE);
-	//ADCSRB = 0; //Free Running mode
 	
-	//Start conversion (first result is invalid)
-	ADCSRA |= (1 << ADSC);
+	//Auto trigger source: Timer/Counter0 Compare Match A
+	//The sample rate is set by adc0_set_rate()
+	ADCSRB = (1 << ADTS1) | (1 << ADTS0);
 	
 	//Disable digital input buffer
 	DIDR0 = (1 << ADC0D);
 }
 				
+//Returns the median of three values
+static inline uint16_t median3(uint16_t a, uint16_t b, uint16_t c){
+	if (a > b){
+		if (b > c) return b;
+		return (a > c) ? c : a;
+	}
+	if (a > c) return a;
+	return (b > c) ? c : b;
+}
+
 // ADC 0
 ISR(ADC_vect){
+	static uint16_t adc_smp_prev[2];	//Two previous raw samples for the median filter
+	static uint16_t adc_acc = 0;		//Accumulator for oversampling
+	static uint8_t adc_acc_cnt = 0;
+
+	PROBE_ON(PRB_ADC);
+
 	//Read ADC Value
-	adc_val = ADC;
+	uint16_t adc_smp = ADC;
+
+	//Clear the Timer0 compare flag, the next compare match triggers the next conversion
+	TIFR0 = (1 << OCF0A);
+	adc_isr_cnt++;
+
+	//Median of three rejects single sample glitches
+	adc_acc += median3(adc_smp, adc_smp_prev[0], adc_smp_prev[1]);
+	adc_smp_prev[1] = adc_smp_prev[0];
+	adc_smp_prev[0] = adc_smp;
+
+	//Decimate: publish a new 12 bit value every ADC_OVS_SAMPLES samples
+	if (++adc_acc_cnt >= ADC_OVS_SAMPLES){
+		adc_val = adc_acc >> ADC_OVS_SHIFT;
+		adc_seq++;
+		sys_evt |= EVT_ADC;
+		adc_acc = 0;
+		adc_acc_cnt = 0;
+	}
+
+	PROBE_OFF(PRB_ADC);
 }
 				
 /*------------------------------------------------------------------------------------------------------
@@ -156,9 +353,7 @@ ISR(ADC_vect){
 int main(void)
 {
 	//Read Data from EEPROM
-	ir_keyset_len = eeprom_read_byte(&eeprom_ir_keyset_len);
-	eeprom_read_block( (void*) ir_keyset , (void*) eeprom_ir_keyset, sizeof(eeprom_ir_keyset));
-	inc_dur = eeprom_read_word(&eeprom_inc_dur);
+	ee_init();				//Replay the EEPROM journal: ir keys and settings
 	
 	//Pin Configurations
 	//Direction Control Register (1=output, 0=input)
@@ -169,6 +364,9 @@ int main(void)
 	
 	//Pullup Config
 	PORTC = ~(1 << PORTC0);					//Deactivate Pullup at PC0
+	#if PROBE_ENABLED
+		PROBE_PORT &= ~(1 << PROBE_PIN);	//Scope probe pin idles low
+	#endif
 	PORTB = (1 << PORTB1) || (1 << PORTB3);	//Activate Pullup at AVR_TXD1_MOSI0, PB1 defined level for U5 buffer
 	//PORTE = 0;			
 	
@@ -176,7 +374,7 @@ int main(void)
 	error_led(FALSE);		//Turn off Error LED
 
 	//Init 5V Power LED
-	if (eeprom_read_byte(&eeprom_pwr_5v_led)){
+	if (pwr_5v_led){
 		//Turn LED on
 		PORTE |= (1 << PWR_5V_LED);
 		} else {
@@ -185,7 +383,7 @@ int main(void)
 	}
 
 	//Init 3V3 Power LED
-	if (eeprom_read_byte(&eeprom_pwr_3v3_led)){
+	if (pwr_3v3_led){
 		//Turn LED on
 		PORTD |= (1 << PWR_3V3_LED);
 		} else {
@@ -195,24 +393,79 @@ int main(void)
 	
 	//Initialize Timers and ADC
     irmp_init();			//initialize IRMP library
+	timer0_init();			//ADC trigger timer
 	timer1_init();			//IRMP Timer
-	timer3_init();			//Volume increment timer
+	timer3_init();			//System tick, software timers
 	adc0_init();			//Potentiometer position adc
 	
 	//INIT UART
-	uart0_init(UART_BAUD_SELECT(BAUDRATE, F_CPU));		//INIT UART0
-	//uart1_init(UART_BAUD_SELECT(BAUDRATE, F_CPU));
+	baud_idx = baud_idx_saved;
+	if (baud_idx >= NUM_BAUDS){
+		baud_idx = BAUD_IDX_DEFAULT;
+	}
+	set_baud(baud_idx);										//INIT UART0
+	uart1_init(UART_BAUD_SELECT_DOUBLE_SPEED(BAUDRATE, F_CPU));	//INIT UART1 (external connector)
 	
-	//Send a firmware identifier via UART0
-	uart0_puts_p(PSTR("BC2 VolCtrl FW: "));
-	uart0_puts_p(PSTR(FW_VERSION));
-	uart0_puts_p(PSTR("\r\n"));
-		
-	_delay_ms(500);			//wait until the boot message of ESP8266 at 74880 baud has passed
 	sei();					//Activate Interrupts
 
+	//Wait until the boot message of ESP8266 at 74880 baud has passed
+	//UART0 is ignored meanwhile, IR and UART1 are already served
+	tmr_start(TMR_BOOT, ESP_BOOT_WAIT_MS, 0);
+
+	set_sleep_mode(SLEEP_MODE_IDLE);
+
+	#if STATS_ENABLED
+		uint16_t pass_ts;
+		uint16_t wake_ts = 0;
+		uint8_t wake_pending = FALSE;
+	#endif
+
 	while (1)
 	{
+		if (tmr_expired(TMR_BOOT)){
+			uart0_flush();	//Discard the received boot message
+
+			//Send a firmware identifier via UART0 and UART1
+			bcast_puts_p(PSTR("BC2 VolCtrl FW: "));
+			bcast_puts_p(PSTR(FW_VERSION));
+			bcast_puts_p(PSTR("\r\n"));
+		}
+
+		//Sleep until an interrupt if there is nothing to do
+		//Check and sleep are atomic: the instruction after sei() is executed before
+		//the next interrupt, an event set in between wakes the CPU right away
+		cli();
+		if (!sys_evt && !fsm_pending()){
+			#if STATS_ENABLED
+				cpu_idle = TRUE;
+			#endif
+			sleep_enable();
+			sei();
+			sleep_cpu();
+			sleep_disable();
+			#if STATS_ENABLED
+				cpu_idle = FALSE;
+				wake_ts = stats_ts();
+				wake_pending = TRUE;
+			#endif
+			continue;
+		}
+		sei();
+
+		#if STATS_ENABLED
+			//Wake-to-dispatch latency
+			pass_ts = stats_ts();
+			if (wake_pending){
+				stats_lat_add(&st.wake_lat, (uint16_t) (pass_ts - wake_ts) * (TIMER3_PRESCALER * 1000000UL / F_CPU));
+				wake_pending = FALSE;
+			}
+		#endif
+
+		sys_evt = 0;
 		fsm();
+
+		#if STATS_ENABLED
+			stats_pass(stats_ts() - pass_ts);
+		#endif
 	}
 }
\ No newline at end of file
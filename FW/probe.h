@@ -0,0 +1,45 @@
+/*
+ * probe.h
+ *
+ * Scope probe pin (probe command). Standalone, so the uart library can mark
+ * its ISRs without depending on volctrl.h
+ *
+ * Created: 19.10.2026
+ */ 
+
+#ifndef PROBE_H_
+#define PROBE_H_
+
+#include <inttypes.h>
+
+#define PROBE_ENABLED			1	//Toggles the scope probe pin (probe command) on or off
+
+//SCOPE PROBE (probe command)
+//The pin is high while the selected section executes, measure with a logic analyzer
+#define PROBE_PORT				PORTC
+#define PROBE_PIN				PORTC2
+#define PRB_NONE				0
+#define PRB_IRMP				1	//Timer 1 ISR (irmp_ISR)
+#define PRB_ADC					2	//ADC ISR
+#define PRB_UART				3	//UART RX and TX ISRs
+#define PRB_TICK				4	//Timer 3 ISR (system tick, software timers)
+#define PRB_FSM					5	//fsm()
+#define PRB_PARSER				6	//cmd_parser()
+//The main loop disables interrupts in uart0_init and in the PRB_ATOMIC sections: the uart tx append
+//(once per string run, ~30 cycles), tmr_start, ee_write and stats_ts (~20 cycles each). About 4 us at
+//8 MHz, the IRMP tick (66 us) is delayed at most by this
+#define PRB_ATOMIC				7	//Interrupt-disabled sections of the main loop
+#define NUM_PRBS				8
+
+#if PROBE_ENABLED
+	extern volatile uint8_t probe_sel;	//Section which drives the pin (PRB_*), main.c
+
+	//PROBE_PORT is in the I/O space: sbi/cbi, the pin does not change the timing of the section
+	#define PROBE_ON(sect)		do { if (probe_sel == (sect)) PROBE_PORT |= (1 << PROBE_PIN); } while (0)
+	#define PROBE_OFF(sect)		do { if (probe_sel == (sect)) PROBE_PORT &= ~(1 << PROBE_PIN); } while (0)
+#else
+	#define PROBE_ON(sect)
+	#define PROBE_OFF(sect)
+#endif
+
+#endif /* PROBE_H_ */
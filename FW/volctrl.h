@@ -10,28 +10,106 @@
 
 #define FW_VERSION				"v1.0"		//Firmware version
 #define F_CPU					8000000UL	//System Clock in in Hz
-#define BAUDRATE				57600		//Baudrate setting
+#define BAUDRATE				57600		//Default baudrate setting (double speed mode)
 
 #define DEBUG_MSG				0	//Toggles Debug Messages on or off
+#define STATS_ENABLED			1	//Toggles the runtime statistics (stats command) on or off
+#define TRACE_ENABLED			1	//Toggles the fsm trace buffer (trace command) on or off
+//PROBE_ENABLED (scope probe pin, probe command) is set in probe.h
+
+#include "probe.h"
+
+//RUNTIME STATISTICS
+#define STATS_HIST_BINS			16	//fsm pass time histogram, bin i counts passes < 2^i timer 3 ticks
+#define STATS_LONG_MS			500	//ms, longer intervals are measured in ms (the tick stamp wraps after 524 ms)
+
+//TRACE BUFFER (trace command)
+//Record: sys_ms (16 bit), type, value, adc_val (16 bit), binary dump little endian
+#define TRACE_LEN				32	//Number of records, power of 2
+#define TRACE_LINE_MAX			24	//Longest text record incl. line end, the binary record frame is shorter
+#define TRC_STATE				0	//FSM_STATE transition, value: new state
+#define TRC_MOTOR				1	//Motor pin change, value: MOTOR_STAT_*
+#define TRC_CMD					2	//Command dispatched, value: CMD_IDX_*
+#define TRC_FAULT				3	//Motor fault, value: MOTOR_FAULT_*
+#define TRC_ERROR				4	//Error, value: TRC_ERR_*
+#define TRC_ERR_SEARCH			1	//Volume search error
+#define TRC_ERR_MOTOR_PINS		2	//Invalid motor pin state (both directions)
+#define TRC_ERR_INCDUR			3	//inc_dur EEPROM RAM mismatch
+#define TRC_ERR_NO_TIMER		4	//Motor running without the increment timer
+
+//EEPROM JOURNAL
+//Settings and ir keys are records in a log of EE_NUM_SEGS segments, written round robin (wear leveling).
+//Segment header: CRC8 | SEQ_L | SEQ_H, record: ID | LEN | PAYLOAD | CRC8. The record CRC is seeded with
+//SEQ_L, records of the previous lap are invalid. Boot replays the segments from the oldest, the last
+//record of an id wins. The segment after the head is kept free: opening a segment compacts the oldest one.
+//Changes are marked with ee_mark(id), ee_task() writes one record at a time with the EE_READY ISR.
+//The first byte commits a record or header: it is invalidated first and written last (power loss).
+//A EE_ID_ERASED end mark follows the last record, stale bytes of the previous lap are never replayed.
+//Segment n always holds a SEQ with SEQ % EE_NUM_SEGS == n. A header is only valid if it is followed by the
+//end mark or a valid record, data of the older fixed layout (imported at the first boot) is not taken as a header.
+#define EE_SEG_SIZE				128
+#define EE_NUM_SEGS				((E2END + 1) / EE_SEG_SIZE)
+#define EE_SEG_HDR				3
+#define EE_SEG_NONE				0xFF
+#define EE_HDR_SEED				0x5A	//Header CRC seed, the old layout bytes 0...2 are no valid header
+#define EE_LOC_NONE				0xFFFF	//No record of the id (default value)
+#define EE_ID_KEY				0		//ir key slots 0 ... IR_KEY_MAX_NUM - 1, LEN 0: deleted
+#define EE_ID_5VLED				(IR_KEY_MAX_NUM)
+#define EE_ID_3V3LED			(IR_KEY_MAX_NUM + 1)
+#define EE_ID_INCDUR			(IR_KEY_MAX_NUM + 2)
+#define EE_ID_BAUD				(IR_KEY_MAX_NUM + 3)
+#define NUM_EE_IDS				(IR_KEY_MAX_NUM + 4)	//Max. 32 (dirty mask)
+#define EE_ID_ERASED			0xFF
+#define EE_SCAN_MAX				8		//Unchanged bytes compared per interrupt (limits the ISR duration)
+
+//MEMORY USAGE (mem command)
+//The free RAM between .bss/heap and the stack is painted at boot, the stack
+//high-water mark is the lowest overwritten byte. RAM per module: avr-nm -S --size-sort VolCtrl_FW.elf
+#define STACK_PAINT				0xC5	//Pattern of unused RAM
 
 //DEFINES FOR THE CMD SET
-#define NUM_CMDS				11	//Numer of commands
+#define NUM_CMDS				17	//Numer of commands
 #define MAX_CMD_WORD_LEN		10  //Maximum cmd word length
 #define MAX_ARG_LEN				10	//Maximum arg word length
 #define MAX_NUM_ARG				3	//Maximum number of arguments
 
 //DEFINES FOR THE REGKEY CMD
 #define IR_KEY_REG_TIMEOUT		5	 //s
-#define IR_KEY_MAX_NUM			13	 //Maxumum number of allowed keys to store in eeprom (larger number needs more ram)
+#define IR_KEY_MAX_NUM			10	 //Maxumum number of allowed keys to store in eeprom (all fit into the journal with max. string lengths)
+#define EE_OLD_KEY_NUM			13	 //Number of keys in the fixed EEPROM layout of older firmware (import)
 
-#define MOTOR_OFF_DELAY_MS		100  //ms, Motor off delay if the rotation direction is changed
+#define MOTOR_OFF_DELAY_MS		100  //ms, Dead time after the motor was turned off
+#define ESP_BOOT_WAIT_MS		500	 //ms, UART0 is ignored until the boot message of the ESP8266 (74880 baud) has passed
+#define REGREM_ANI_MS			90	 //ms, Period of the regrem wait animation
+
+//ADC OVERSAMPLING
+//The ADC ISR median filters the 10 bit samples, accumulates ADC_OVS_SAMPLES
+//of them and publishes a 12 bit position value in adc_val
+#define ADC_OVS_SAMPLES			16	//Number of accumulated samples (4^ADC_EXTRA_BITS)
+#define ADC_OVS_SHIFT			2	//Decimation shift of the accumulated value
+#define ADC_EXTRA_BITS			2	//Bits of resolution gained by oversampling
+
+//ADC TRIGGER RATES (TIMER0 COMPARE MATCH A)
+#define ADC_RATE_LO				0	//Idle: detect manual knob turns
+#define ADC_RATE_HI				1	//Motor running or volume command active
+#define TIMER0_PRESCALER_VAL_LO	(1 << CS02)					//TIMER0 Prescaler=256
+#define TIMER0_OCR_LO			124							//8MHz/256/125 = 250Hz
+#define TIMER0_PRESCALER_VAL_HI	((1 << CS01) | (1 << CS00))	//TIMER0 Prescaler=64
+#define TIMER0_OCR_HI			30							//8MHz/64/31 = 4032Hz (max. ADC rate ~4.6kHz)
+
+//MACRO TO SCALE A 10 BIT ADC VALUE TO THE RESOLUTION OF adc_val
+#define ADC_FROM_10BIT(val)		((uint16_t) (val) << ADC_EXTRA_BITS)
 
 //ADC POTENTIOMETER HIGH/LOW THRESHOLD
-#define ADC_POT_HI_TH			1023
-#define ADC_POT_LO_TH			9
+#define ADC_POT_HI_TH			ADC_FROM_10BIT(1023)
+#define ADC_POT_LO_TH			ADC_FROM_10BIT(9)
 
-//TOLERANCE OF THE SETVOL CMD in LSBs
-#define SETVOL_TOL				1
+//TOLERANCE OF THE SETVOL CMD in LSBs (12 bit)
+#define SETVOL_TOL				4
+
+//SETVOL RAMP (setvol <pct> <ms>)
+#define SETVOL_RAMP_MAX_MS		30000	//ms, maximum ramp duration
+#define SETVOL_RAMP_HYST		8		//LSBs (12 bit), the motor restarts if it falls behind the trajectory by this value
 
 //EEPROM DEFAULT INC DURATION IN MS
 #define EEPROM_INC_DURATION		150 //1400ms max.
@@ -41,12 +119,27 @@
 #define ADC_POT_STAT_HI			2
 #define ADC_POT_STAT_OK			0
 
-#define TIMER3_PRESCALER_VAL	(1 << CS32) //TIMER1 Prescaler=256
-#define TIMER3_PRESCALER		256
+//TIMER3: 1 MS SYSTEM TICK (SOFTWARE TIMER SERVICE)
+#define TIMER3_PRESCALER_VAL	((1 << CS31) | (1 << CS30)) //TIMER3 Prescaler=64
+#define TIMER3_PRESCALER		64
 
-//MACRO TO CALCULATE THE TIMER VALUE FOR INC_DURATION
+//MACRO TO CALCULATE THE TIMER COMPARE VALUE FOR A DURATION IN MS
 #define TIMER_COMP_VAL(prescaler,duration) ((float) duration*F_CPU/prescaler/1000)
 
+//MAIN LOOP EVENTS (sys_evt), set by the interrupts
+//The main loop sleeps (SLEEP_MODE_IDLE) until an event or fsm_pending() requests a fsm() pass
+#define EVT_IR					(1 << 0)	//IRMP decoded a frame
+#define EVT_ADC					(1 << 1)	//New adc value published
+#define EVT_TMR					(1 << 2)	//Software timer expired or telemetry sample due
+
+//SOFTWARE TIMERS (IDs, max. 8)
+#define TMR_INC					0	//Volume increment duration (inc_dur)
+#define TMR_MOTOR_DEAD			1	//Motor dead time (MOTOR_OFF_DELAY_MS)
+#define TMR_REGREM				2	//regrem timeout (IR_KEY_REG_TIMEOUT)
+#define TMR_ANI					3	//regrem wait animation
+#define TMR_BOOT				4	//ESP8266 boot message wait
+#define NUM_TMRS				5
+
 // PIN DEFINES
 #define PIN_MOTOR_CW			PORTD3
 #define PIN_MOTOR_CCW			PORTD2
@@ -59,6 +152,62 @@
 #define MOTOR_STAT_CW			1
 #define MOTOR_STAT_CCW			2
 
+//MANUAL KNOB TURN DETECTION ("vol <pct>" notifications)
+#define KNOB_HYST_PCT8			0x100	//Position change (percent, 8.8 fixed point) which counts as a knob turn
+#define KNOB_DEBOUNCE_MS		50		//ms, a position change has to persist this long
+#define KNOB_NOTIFY_MS			200		//ms, minimum interval between two notifications
+#define KNOB_SETTLE_MS			300		//ms, detection starts this long after the motor stopped
+
+//MOTOR FAULT CODES (STALL AND RUNAWAY DETECTION)
+#define MOTOR_FAULT_NONE		0
+#define MOTOR_FAULT_STALL		1	//Motor driven, but the pot position does not change
+#define MOTOR_FAULT_RUNAWAY		2	//Pot position moves against the rotation direction
+
+//MOTOR MONITOR THRESHOLDS
+#define MOTOR_MON_MIN_LSB		2	 //LSBs (12 bit), minimum position change which counts as movement
+#define MOTOR_MON_RUNAWAY_LSB	12	 //LSBs (12 bit), movement against the rotation direction which is a fault
+//The motor runs with ADC_RATE_HI: a new adc value every ~4 ms (4032 Hz / ADC_OVS_SAMPLES)
+#define MOTOR_MON_SPINUP_MS		50	 //ms, time without movement allowed after the motor start (spin-up, rate switch)
+#define MOTOR_MON_STALL_MS		20	 //ms, maximum time without movement (5 adc values at ADC_RATE_HI)
+//Not detected within a few ms: the flat ends of the log pot curve move ~1 LSB per 100 ms
+#define MOTOR_MON_STALL_FLAT_MS	1000 //ms, maximum time without movement in the flat regions of the pot curve
+#define MOTOR_MON_FLAT_LO		ADC_FROM_10BIT(32)	 //Upper adc value of the flat region at the lower end of the pot curve
+#define MOTOR_MON_FLAT_HI		ADC_FROM_10BIT(1016) //Lower adc value of the flat region at the upper end of the pot curve
+
+//SHOWREM TABLE OUTPUT (streamed one row half per main loop pass)
+#define SHOWREM_IDLE			0xFF	//No table output active
+#define SHOWREM_BUF_LEN			52		//Longest row half incl. NUL, must be smaller than the UART TX buffer
+
+//STATS REPORT OUTPUT (streamed one line per main loop pass)
+#define STATS_IDLE				0xFF	//No report output active
+#define STATS_LINE_MAX			56		//Longest report line, must be smaller than the UART TX buffer
+
+//UART0 BAUDRATES (double speed mode, index into baud_rates[])
+#define BAUD_IDX_57600			0		//+2.1% error on 8 MHz
+#define BAUD_IDX_250K			1		//exact on 8 MHz
+#define BAUD_IDX_500K			2		//exact on 8 MHz
+#define BAUD_IDX_1M				3		//exact on 8 MHz
+#define NUM_BAUDS				4
+#define BAUD_IDX_DEFAULT		BAUD_IDX_57600
+#define BAUD_MAX_ERR_PERMILLE	25		//Maximum allowed baudrate error (checked at compile time)
+#define BAUD_CONFIRM_MS			3000	//ms, a new baudrate has to be confirmed within this time
+#define BAUD_SETTLE_MS			2		//ms, empty transmit queue before a switch (shift register, 1 ms tick)
+#define BAUD_IDX_NONE			0xFF	//No baudrate switch requested
+
+//TELEMETRY STREAM ("stream <hz> [b]")
+#define STREAM_MAX_HZ			100		//Maximum sample rate
+#define STREAM_FRAME_LEN		8		//Length of a binary sample frame (4 byte payload)
+
+//MOTION COMPLETION EVENTS ("done <id> <adc> <ms>" / "fail <id> <reason>")
+#define MOTION_DONE				0	//Target reached or increment finished
+#define MOTION_FAIL_LIMIT		1	//Motor at the limit of the potentiometer
+#define MOTION_FAIL_SEARCH		2	//Volume search error (target passed)
+#define MOTION_FAIL_FAULT		3	//Motor stall or runaway
+#define MOTION_FAIL_ABORT		4	//Stopped by another command
+#define MOTION_FAIL_REPLACED	5	//Retriggered by a new volume command
+#define MOTION_FAIL_ERROR		6	//Command rejected by the parser or the command (cmd_reject)
+#define MOTION_FAIL_DROPPED		7	//Queued command dropped by a new line
+
 //CMD INDEXES
 //has to be unique
 #define CMD_IDX_VOLUP			0
@@ -72,6 +221,12 @@
 #define CMD_IDX_SET3V3LED		8
 #define CMD_IDX_SETINCDUR		9
 #define CMD_IDX_GETINCDUR		10
+#define CMD_IDX_STATS			11
+#define CMD_IDX_SETBAUD			12
+#define CMD_IDX_STREAM			13
+#define CMD_IDX_TRACE			14
+#define CMD_IDX_PROBE			15
+#define CMD_IDX_MEM				16
 
 //FSM STATES 
 #define STATE_INIT				0
@@ -81,6 +236,27 @@
 #define STATE_SETVOL_ACT		4
 #define STATE_VOLUP_ACT			5
 #define STATE_VOLDOWN_ACT		6
+#define STATE_SETVOL_RAMP		7
+#define STATE_SETVOL_RAMP_ACT	8
+#define NUM_STATES				9	//Max. 15 (packed transition table)
+
+//FSM EVENTS (columns of the transition table in fsm.c)
+#define EV_NONE					0	//No event, the state action runs (entry states, ramp tracking)
+#define EV_FAULT				1	//Motor protection fault
+#define EV_REQ_VOLUP			2	//Motion requests, posted by the command handlers
+#define EV_REQ_VOLDOWN			3
+#define EV_REQ_SETVOL			4
+#define EV_REQ_RAMP				5
+#define EV_LIMIT				6	//Potentiometer at the limit in rotation direction
+#define EV_INC_EXP				7	//Volume increment timer expired
+#define EV_TARGET				8	//setvol target reached (SETVOL_TOL)
+#define EV_PASSED				9	//Volume search passed the target
+#define EV_RAMP_END				10	//Ramp duration elapsed
+#define EV_CMD_VOLUP			11	//Received commands (UART or IR)
+#define EV_CMD_VOLDOWN			12
+#define EV_CMD_SETVOL			13
+#define EV_CMD_OTHER			14
+#define NUM_EVENTS				15
 
 
 #ifndef TRUE
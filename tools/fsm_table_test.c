@@ -0,0 +1,172 @@
+/*
+ * fsm_table_test.c
+ *
+ * Host test of the fsm transition table (FW/CMD/fsm_table.h). All NUM_STATES x NUM_EVENTS
+ * entries are compared against the behavior of the switch based fsm which the table replaced.
+ *
+ * Build and run from the repository root:
+ *   gcc -std=gnu99 -Wall -o fsm_table_test tools/fsm_table_test.c && ./fsm_table_test
+ *
+ * Created: 19.10.2026
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define PROGMEM
+#include "../FW/CMD/fsm_table.h"
+
+#define TRUE	1
+#define FALSE	0
+
+static const char *state_names[NUM_STATES] = {"INIT", "VOLUP", "VOLDOWN", "SETVOL", "SETVOL_ACT",
+	"VOLUP_ACT", "VOLDOWN_ACT", "SETVOL_RAMP", "SETVOL_RAMP_ACT"};
+
+static const char *event_names[NUM_EVENTS] = {"NONE", "FAULT", "REQ_VOLUP", "REQ_VOLDOWN", "REQ_SETVOL",
+	"REQ_RAMP", "LIMIT", "INC_EXP", "TARGET", "PASSED", "RAMP_END", "CMD_VOLUP", "CMD_VOLDOWN",
+	"CMD_SETVOL", "CMD_OTHER"};
+
+//Received command in a state which checked for new commands
+//check_for_new_cmds_volupdown_act(): volup/voldown retrigger, everything else aborts
+static uint8_t old_cmd_volupdown_act(uint8_t ev){
+	switch (ev){
+		case EV_CMD_VOLUP:		return T(A_CMD_RETRIG, STATE_VOLUP);
+		case EV_CMD_VOLDOWN:	return T(A_CMD_RETRIG, STATE_VOLDOWN);
+		default:				return T(A_ABORT, STATE_INIT);
+	}
+}
+
+//check_for_new_cmds_setvol_act(): volup/voldown are dismissed, setvol is executed
+//(retrigger), everything else aborts and is executed in STATE_INIT
+static uint8_t old_cmd_setvol_act(uint8_t ev){
+	switch (ev){
+		case EV_CMD_VOLUP:
+		case EV_CMD_VOLDOWN:	return T(A_CMD_DROP, S_SAME);
+		case EV_CMD_SETVOL:		return T(A_CMD_EXEC, S_SAME);
+		default:				return T(A_ABORT, STATE_INIT);
+	}
+}
+
+//Expected entry, transcribed from the cases of the former switch in fsm()
+static uint8_t old_switch(uint8_t state, uint8_t ev){
+	//The motor monitor forced STATE_INIT in every state, before the switch
+	if (ev == EV_FAULT){
+		return T(A_FAULT, STATE_INIT);
+	}
+
+	//The command handlers wrote FSM_STATE directly, in every state
+	switch (ev){
+		case EV_REQ_VOLUP:		return T(A_NONE, STATE_VOLUP);
+		case EV_REQ_VOLDOWN:	return T(A_NONE, STATE_VOLDOWN);
+		case EV_REQ_SETVOL:		return T(A_NONE, STATE_SETVOL);
+		case EV_REQ_RAMP:		return T(A_NONE, STATE_SETVOL_RAMP);
+		default:				break;
+	}
+
+	switch (state){
+		case STATE_INIT:
+			//Every received command went to the cmd parser
+			if (ev >= EV_CMD_VOLUP){
+				return T(A_CMD_EXEC, S_SAME);
+			}
+			return T_IGN;
+
+		case STATE_VOLUP:
+		case STATE_VOLDOWN:
+			//Limit check first, then start the increment. Commands wait for the _ACT state
+			if (ev == EV_LIMIT){
+				return T(A_LIMIT, STATE_INIT);
+			}
+			if (ev == EV_NONE){
+				return T(A_STEP_START, (state == STATE_VOLUP) ? STATE_VOLUP_ACT : STATE_VOLDOWN_ACT);
+			}
+			return T_IGN;
+
+		case STATE_VOLUP_ACT:
+		case STATE_VOLDOWN_ACT:
+			if (ev == EV_INC_EXP){
+				return T(A_STOP, STATE_INIT);
+			}
+			if (ev == EV_LIMIT){
+				return T(A_LIMIT, STATE_INIT);
+			}
+			if (ev >= EV_CMD_VOLUP){
+				return old_cmd_volupdown_act(ev);
+			}
+			return T_IGN;
+
+		case STATE_SETVOL:
+			if (ev == EV_TARGET){
+				return T(A_STOP, STATE_INIT);
+			}
+			if (ev == EV_NONE){
+				return T(A_SEEK_START, STATE_SETVOL_ACT);
+			}
+			return T_IGN;
+
+		case STATE_SETVOL_ACT:
+			//Target first: a target within the tolerance is no search error
+			if (ev == EV_TARGET){
+				return T(A_STOP, STATE_INIT);
+			}
+			if (ev == EV_PASSED){
+				return T(A_SEARCH_ERR, STATE_INIT);
+			}
+			if (ev >= EV_CMD_VOLUP){
+				return old_cmd_setvol_act(ev);
+			}
+			return T_IGN;
+
+		case STATE_SETVOL_RAMP:
+			if (ev == EV_NONE){
+				return T(A_RAMP_START, STATE_SETVOL_RAMP_ACT);
+			}
+			return T_IGN;
+
+		case STATE_SETVOL_RAMP_ACT:
+			//End of the trajectory -> final approach in STATE_SETVOL
+			if (ev == EV_RAMP_END){
+				return T(A_NONE, STATE_SETVOL);
+			}
+			if (ev == EV_LIMIT){
+				return T(A_LIMIT, STATE_INIT);
+			}
+			if (ev == EV_NONE){
+				return T(A_RAMP_TRACK, S_SAME);
+			}
+			if (ev >= EV_CMD_VOLUP){
+				return old_cmd_setvol_act(ev);
+			}
+			return T_IGN;
+
+		default:
+			return T_IGN;
+	}
+}
+
+int main(void){
+	uint8_t fail = 0;
+	uint8_t exp, act;
+
+	for (uint8_t s = 0; s < NUM_STATES; s++){
+		for (uint8_t e = 0; e < NUM_EVENTS; e++){
+			act = fsm_table[s][e];
+			exp = old_switch(s, e);
+
+			//Every entry has to point to a valid action and state
+			if ( (T_ACT(act) > A_RAMP_TRACK) || ((T_NEXT(act) >= NUM_STATES) && (T_NEXT(act) != S_SAME)) ){
+				printf("FAIL %s/%s: invalid entry 0x%02X\n", state_names[s], event_names[e], act);
+				fail++;
+				continue;
+			}
+			if (act != exp){
+				printf("FAIL %s/%s: action %u next %u, expected action %u next %u\n", state_names[s], event_names[e],
+				T_ACT(act), T_NEXT(act), T_ACT(exp), T_NEXT(exp));
+				fail++;
+			}
+		}
+	}
+
+	printf("%u of %u entries checked, %u failed\n", NUM_STATES * NUM_EVENTS, NUM_STATES * NUM_EVENTS, fail);
+	return fail ? 1 : 0;
+}
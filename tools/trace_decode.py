@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+"""Decodes a binary trace dump ("trace b") of the BC2_VolCtrl firmware.
+
+Reads the raw bytes received from the UART (file or stdin) and prints one
+line per record in the format of the text dump: "<ms> <type> <value> <adc>".
+
+Frame: SYNC | OPCODE | LEN | PAYLOAD | CRC8 (FW/CMD/cmdparser.h)
+Record payload: trace_entry, little endian (FW/CMD/cmd.h)
+    uint16 ms, uint8 type (TRC_*), uint8 value, uint16 adc
+The dump ends with an empty frame. Text output and the status reply of a
+trace request frame (LEN 3) between the records are skipped.
+
+Usage: trace_decode.py [capture.bin]
+"""
+
+import struct
+import sys
+
+FRAME_SYNC = 0xA5
+FRAME_REPLY = 0x80
+CMD_IDX_TRACE = 14
+TRACE_OP = CMD_IDX_TRACE | FRAME_REPLY
+TRACE_ENTRY = struct.Struct("<HBBH")
+
+TRC_NAMES = ["STATE", "MOTOR", "CMD", "FAULT", "ERROR"]
+
+
+def crc8_ccitt(data):
+    """Same as _crc8_ccitt_update() of avr-libc, polynomial 0x07, start value 0."""
+    crc = 0
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x07) & 0xFF if crc & 0x80 else (crc << 1) & 0xFF
+    return crc
+
+
+def frames(buf):
+    """Yields (opcode, payload) of all frames with a valid CRC."""
+    i = 0
+    while i + 4 <= len(buf):
+        if buf[i] != FRAME_SYNC:
+            i += 1
+            continue
+        op, length = buf[i + 1], buf[i + 2]
+        end = i + 3 + length
+        if end >= len(buf) or crc8_ccitt(buf[i + 1:end]) != buf[end]:
+            # No frame at this SYNC byte (e.g. 0xA5 in a text line)
+            i += 1
+            continue
+        yield op, buf[i + 3:end]
+        i = end + 1
+
+
+def decode(buf, out):
+    """Prints the records of the dump, returns FALSE if the end frame is missing."""
+    for op, payload in frames(buf):
+        if op != TRACE_OP:
+            continue
+        if len(payload) == 0:
+            return True
+        if len(payload) != TRACE_ENTRY.size:
+            # Status reply of the trace request frame
+            continue
+        ms, typ, val, adc = TRACE_ENTRY.unpack(payload)
+        name = TRC_NAMES[typ] if typ < len(TRC_NAMES) else str(typ)
+        out.write("%u %s %u %u\n" % (ms, name, val, adc))
+    return False
+
+
+def main():
+    if len(sys.argv) > 1:
+        with open(sys.argv[1], "rb") as f:
+            buf = f.read()
+    else:
+        buf = sys.stdin.buffer.read()
+
+    if not decode(buf, sys.stdout):
+        sys.stderr.write("trace_decode: end of dump not found\n")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())